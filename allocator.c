@@ -0,0 +1,3 @@
+#include "allocator.h"
+
+_Thread_local tcache tcacheLocal;
@@ -0,0 +1,361 @@
+#pragma once
+
+#include "common.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+/**
+ * Allocators to give to anything that takes an allocator (see common.h):
+ *  - arena hands out memory from large chunks, bumping a pointer. Only
+ *    the latest allocation can be freed or grown in place. All of it is
+ *    released at once by arenaFree, or arenaReset, with one free per
+ *    chunk, so a whole request's memory goes in O(1).
+ *  - pool hands out blocks of one fixed size from a free list, for many
+ *    objects of the same type. Larger requests go to malloc.
+ *  - tcacheallocator keeps each thread's recently freed small blocks,
+ *    by power of two size class, to reuse without a call to malloc.
+ *    Its caches live in allocator.c, which must be linked.
+ *
+ * An arena or pool must not move once an allocator has been taken from
+ * it, as the allocator points to it. Neither is thread safe.
+ */
+
+enum {
+    /*Everything is aligned for any type*/
+    allocator_align = _Alignof(max_align_t)
+};
+
+static inline size_t allocatorAlign (size_t size) {
+    return (size + allocator_align-1) & ~(size_t) (allocator_align-1);
+}
+
+/*==== arena ====*/
+
+typedef struct arenaChunk {
+    struct arenaChunk* prev;
+    /*Keeps the memory after the header aligned*/
+    max_align_t data[];
+} arenaChunk;
+
+typedef struct arena {
+    /*The chunk being allocated from, which links the rest*/
+    arenaChunk* chunk;
+    char *at, *end;
+    size_t chunkSize;
+} arena;
+
+static arena arenaInit (size_t chunkSize);
+
+/*Frees everything allocated from it*/
+static arena* arenaFree (arena* a);
+
+/*Frees everything allocated from it, but keeps the current chunk*/
+static void arenaReset (arena* a);
+
+static void* arenaMalloc (arena* a, size_t size);
+
+static allocator arenaAllocator (arena* a);
+
+/*==== pool ====*/
+
+typedef struct pool {
+    size_t size;
+    int perChunk;
+    /*Freed blocks, each linking the next*/
+    void* freelist;
+    /*Chunks, each linking the previous in its first block*/
+    void* chunks;
+} pool;
+
+/*Blocks of at least size bytes, allocated perChunk at a time*/
+static pool poolInit (size_t size, int perChunk);
+static pool* poolFree (pool* p);
+
+static void* poolMalloc (pool* p);
+static void poolRelease (pool* p, void* block);
+
+static allocator poolAllocator (pool* p);
+
+/*==== tcacheallocator ====*/
+
+/*Frees the blocks cached by the calling thread, e.g. as it exits*/
+static void tcacheFlush (void);
+
+/*==== Inline implementations ====*/
+
+static inline arena arenaInit (size_t chunkSize) {
+    return (arena) {.chunkSize = allocatorAlign(chunkSize)};
+}
+
+static inline arenaChunk* arenaChunkInit (size_t size, arenaChunk* prev) {
+    arenaChunk* chunk = malloc(sizeof(arenaChunk) + size);
+    chunk->prev = prev;
+    return chunk;
+}
+
+static inline arena* arenaFree (arena* a) {
+    for (arenaChunk* chunk = a->chunk, *prev; chunk; chunk = prev) {
+        prev = chunk->prev;
+        free(chunk);
+    }
+
+    a->chunk = 0;
+    a->at = a->end = 0;
+    return a;
+}
+
+static inline void arenaReset (arena* a) {
+    if (!a->chunk)
+        return;
+
+    for (arenaChunk* chunk = a->chunk->prev, *prev; chunk; chunk = prev) {
+        prev = chunk->prev;
+        free(chunk);
+    }
+
+    a->chunk->prev = 0;
+    a->at = (char*) a->chunk->data;
+}
+
+static inline void* arenaMalloc (arena* a, size_t size) {
+    size = allocatorAlign(size);
+
+    if ((size_t) (a->end - a->at) >= size) {
+        void* ptr = a->at;
+        a->at += size;
+        return ptr;
+    }
+
+    /*Big ones get their own chunk, behind the current one, so as not
+      to waste what's left of it*/
+    if (size > a->chunkSize/4 && a->chunk) {
+        a->chunk->prev = arenaChunkInit(size, a->chunk->prev);
+        return a->chunk->prev->data;
+    }
+
+    size_t chunkSize = size > a->chunkSize ? size : a->chunkSize;
+    a->chunk = arenaChunkInit(chunkSize, a->chunk);
+    a->at = (char*) a->chunk->data + size;
+    a->end = (char*) a->chunk->data + chunkSize;
+    return a->chunk->data;
+}
+
+static inline void* arenaAllocatorMalloc (const allocator* self, size_t size) {
+    return arenaMalloc(self->ctx, size);
+}
+
+/*Only the latest allocation is given back, or grown in place*/
+static inline bool arenaIsLatest (const arena* a, void* ptr, size_t size) {
+    return (char*) ptr + allocatorAlign(size) == a->at;
+}
+
+static inline void* arenaAllocatorRealloc (const allocator* self, void* ptr, size_t oldSize, size_t size) {
+    arena* a = self->ctx;
+
+    if (ptr && arenaIsLatest(a, ptr, oldSize) && (char*) ptr + allocatorAlign(size) <= a->end) {
+        a->at = (char*) ptr + allocatorAlign(size);
+        return ptr;
+    }
+
+    void* copy = arenaMalloc(a, size);
+
+    if (ptr)
+        memcpy(copy, ptr, oldSize < size ? oldSize : size);
+
+    return copy;
+}
+
+static inline void arenaAllocatorFree (const allocator* self, void* ptr, size_t size) {
+    arena* a = self->ctx;
+
+    if (arenaIsLatest(a, ptr, size))
+        a->at = ptr;
+}
+
+static inline allocator arenaAllocator (arena* a) {
+    return (allocator) {arenaAllocatorMalloc, arenaAllocatorRealloc, arenaAllocatorFree, {.ctx = a}};
+}
+
+static inline pool poolInit (size_t size, int perChunk) {
+    /*Room to link them when free*/
+    size = size < sizeof(void*) ? sizeof(void*) : size;
+
+    return (pool) {
+        .size = allocatorAlign(size),
+        .perChunk = perChunk < 1 ? 1 : perChunk
+    };
+}
+
+static inline pool* poolFree (pool* p) {
+    for (void* chunk = p->chunks, *prev; chunk; chunk = prev) {
+        prev = *(void**) chunk;
+        free(chunk);
+    }
+
+    p->chunks = p->freelist = 0;
+    return p;
+}
+
+static inline void* poolMalloc (pool* p) {
+    if (!p->freelist) {
+        /*The first block of each chunk links the chunks*/
+        char* chunk = malloc(p->size * (p->perChunk+1));
+        *(void**) chunk = p->chunks;
+        p->chunks = chunk;
+
+        for (int i = p->perChunk; i >= 1; i--) {
+            void* block = chunk + i*p->size;
+            *(void**) block = p->freelist;
+            p->freelist = block;
+        }
+    }
+
+    void* block = p->freelist;
+    p->freelist = *(void**) block;
+    return block;
+}
+
+static inline void poolRelease (pool* p, void* block) {
+    *(void**) block = p->freelist;
+    p->freelist = block;
+}
+
+static inline void* poolAllocatorMalloc (const allocator* self, size_t size) {
+    pool* p = self->ctx;
+    return size <= p->size ? poolMalloc(p) : malloc(size);
+}
+
+static inline void poolAllocatorFree (const allocator* self, void* ptr, size_t size) {
+    pool* p = self->ctx;
+
+    if (size <= p->size)
+        poolRelease(p, ptr);
+
+    else
+        free(ptr);
+}
+
+static inline void* poolAllocatorRealloc (const allocator* self, void* ptr, size_t oldSize, size_t size) {
+    pool* p = self->ctx;
+
+    if (!ptr)
+        return poolAllocatorMalloc(self, size);
+
+    else if (oldSize <= p->size && size <= p->size)
+        return ptr;
+
+    else if (oldSize > p->size && size > p->size)
+        return realloc(ptr, size);
+
+    void* copy = poolAllocatorMalloc(self, size);
+
+    /*Leaving the original, as realloc does*/
+    if (!copy)
+        return 0;
+
+    memcpy(copy, ptr, oldSize < size ? oldSize : size);
+    poolAllocatorFree(self, ptr, oldSize);
+    return copy;
+}
+
+static inline allocator poolAllocator (pool* p) {
+    return (allocator) {poolAllocatorMalloc, poolAllocatorRealloc, poolAllocatorFree, {.ctx = p}};
+}
+
+enum {
+    /*Size classes of 16, 32, ... 1024 bytes*/
+    tcache_minShift = 4,
+    tcache_classes = 7,
+    /*Blocks kept per class, beyond which they go back to free*/
+    tcache_maxCached = 64
+};
+
+typedef struct tcache {
+    void* lists[tcache_classes];
+    int counts[tcache_classes];
+} tcache;
+
+/*The calling thread's cache. Defined once, in allocator.c, so that
+  every translation unit shares it, and tcacheFlush empties all of it.*/
+extern _Thread_local tcache tcacheLocal;
+
+/*The size class, or -1 if too big to cache*/
+static inline int tcacheClass (size_t size) {
+    int sizeClass = 0;
+
+    /*Stopping at the largest, so the shift can't overflow*/
+    while (sizeClass < tcache_classes && ((size_t) 1 << (sizeClass + tcache_minShift)) < size)
+        sizeClass++;
+
+    return sizeClass < tcache_classes ? sizeClass : -1;
+}
+
+static inline void* tcacheMalloc (const allocator* self, size_t size) {
+    (void) self;
+    int sizeClass = tcacheClass(size);
+
+    if (sizeClass < 0)
+        return malloc(size);
+
+    void* block = tcacheLocal.lists[sizeClass];
+
+    if (!block)
+        return malloc((size_t) 1 << (sizeClass + tcache_minShift));
+
+    tcacheLocal.lists[sizeClass] = *(void**) block;
+    tcacheLocal.counts[sizeClass]--;
+    return block;
+}
+
+static inline void tcacheRelease (const allocator* self, void* ptr, size_t size) {
+    (void) self;
+    int sizeClass = tcacheClass(size);
+
+    if (sizeClass < 0 || tcacheLocal.counts[sizeClass] == tcache_maxCached) {
+        free(ptr);
+        return;
+    }
+
+    *(void**) ptr = tcacheLocal.lists[sizeClass];
+    tcacheLocal.lists[sizeClass] = ptr;
+    tcacheLocal.counts[sizeClass]++;
+}
+
+static inline void* tcacheRealloc (const allocator* self, void* ptr, size_t oldSize, size_t size) {
+    int oldClass = tcacheClass(oldSize), sizeClass = tcacheClass(size);
+
+    if (!ptr)
+        return tcacheMalloc(self, size);
+
+    /*The block is already big enough*/
+    else if (oldClass >= 0 && oldClass == sizeClass)
+        return ptr;
+
+    else if (oldClass < 0 && sizeClass < 0)
+        return realloc(ptr, size);
+
+    void* copy = tcacheMalloc(self, size);
+
+    /*Leaving the original, as realloc does*/
+    if (!copy)
+        return 0;
+
+    memcpy(copy, ptr, oldSize < size ? oldSize : size);
+    tcacheRelease(self, ptr, oldSize);
+    return copy;
+}
+
+static inline void tcacheFlush (void) {
+    for (int sizeClass = 0; sizeClass < tcache_classes; sizeClass++) {
+        for (void* block = tcacheLocal.lists[sizeClass], *next; block; block = next) {
+            next = *(void**) block;
+            free(block);
+        }
+
+        tcacheLocal.lists[sizeClass] = 0;
+        tcacheLocal.counts[sizeClass] = 0;
+    }
+}
+
+#define tcacheallocator ((allocator) {tcacheMalloc, tcacheRealloc, tcacheRelease, {0}})
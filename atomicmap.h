@@ -0,0 +1,536 @@
+#pragma once
+
+#include "common.h"
+#include "hashmap.h"
+
+#include <stdatomic.h>
+#include <threads.h>
+
+/**
+ * An intmap that many threads can insert into, remove from, and look up
+ * in at the same time, without locks.
+ *
+ * Open addressing with linear probing, like generalmap. A key is claimed
+ * in its slot with a CAS and never moves again within a table; its value
+ * is then changed with CASes. Removal leaves the key, with a tombstone.
+ *
+ * When a table gets 3/4 full of keys, live or removed, the writer that
+ * notices links a successor, sized for the live entries alone, so that
+ * churning through keys doesn't grow it. Each slot is then frozen and
+ * copied across by any thread that meets it, and every writer also copies
+ * a chunk of slots. Once each slot has been copied, the successor takes
+ * the table's place. No thread ever waits for another: a helper that
+ * stalls mid-chunk leaves slots that any other can finish.
+ *
+ * Replaced tables are freed once no thread can still be in them, tracked
+ * by epochs, with counts of the threads in each spread over cache lines.
+ *
+ * As with intmap, a key can be mapped to null, and is present until
+ * removed. Unlike intmap, the key INTPTR_MIN is reserved to mark empty
+ * slots, and the top two bits of values to mark the state of a slot (no
+ * user space pointer has them set, on common 64 bit platforms, but small
+ * negative integers do). atomicintmapAdd refuses them.
+ */
+
+typedef struct atomicmapSlot {
+    _Atomic intptr_t key;
+    /*A value, or one of the states below*/
+    _Atomic uintptr_t value;
+} atomicmapSlot;
+
+typedef struct atomicmapTable {
+    int size;
+    /*Slots with a key claimed, live or not*/
+    _Atomic int claimed;
+    atomicmapSlot* slots;
+
+    /*The table being copied into, once it's full*/
+    _Atomic(struct atomicmapTable*) next;
+    /*The next chunk of slots to be copied, and how many are done*/
+    _Atomic int copyAt, copied;
+
+    /*Once replaced: the epoch it was in, and the other tables waiting
+      to be freed*/
+    uint64_t retiredIn;
+    struct atomicmapTable* retiredNext;
+} atomicmapTable;
+
+enum {
+    atomicmap_copy_slots = 256,
+    /*Threads spread their counts over this many cache lines*/
+    atomicmap_stripes = 16
+};
+
+typedef struct atomicmapStripe {
+    /*Threads inside the map, by the parity of the epoch they entered in*/
+    _Alignas(64) _Atomic int active[2];
+} atomicmapStripe;
+
+typedef struct atomicintmap {
+    /*The oldest table not yet replaced, which links any newer*/
+    _Atomic(atomicmapTable*) table;
+
+    _Atomic uint64_t epoch;
+    atomicmapStripe* stripes;
+    /*Replaced tables, to be freed. Only one thread frees at a time.*/
+    _Atomic(atomicmapTable*) retired;
+    mtx_t reclaimLock;
+} atomicintmap;
+
+#define atomicmap_empty INTPTR_MIN
+
+/*Value states. A present value, even null, is stored with the present
+  bit set, and a removed one is a tombstone. A frozen slot is being copied
+  into the next table, and its state (which can no longer change) is
+  below the frozen bit. Once copied, it's marked with whether there was
+  any value, even a tombstone.*/
+#define atomicmap_frozen ((uintptr_t) 1 << (sizeof(uintptr_t)*8 - 1))
+#define atomicmap_present ((uintptr_t) 1 << (sizeof(uintptr_t)*8 - 2))
+#define atomicmap_reserved (atomicmap_frozen | atomicmap_present)
+#define atomicmap_tombstone ((uintptr_t) 1)
+#define atomicmap_copiedEmpty atomicmap_frozen
+#define atomicmap_copiedFull (atomicmap_frozen | atomicmap_tombstone)
+
+/**
+ * As with generalmapInit, size is rounded up to a power of two.
+ */
+static atomicintmap* atomicintmapInit (atomicintmap* map, int size);
+
+/**
+ * Frees every table. No other thread may be using it.
+ */
+static atomicintmap* atomicintmapFree (atomicintmap* map);
+
+/**
+ * Returns whether the key was already present, or -1, changing nothing,
+ * for the reserved key or a value with either of the top two bits set.
+ */
+static int atomicintmapAdd (atomicintmap* map, intptr_t element, void* value);
+static void* atomicintmapMap (atomicintmap* map, intptr_t element);
+static bool atomicintmapRemove (atomicintmap* map, intptr_t element);
+
+/*==== Inline implementations ====*/
+
+static inline atomicmapTable* atomicmapTableInit (int size) {
+    /*Keep to a power of two, for the mask*/
+    int capacity = 4;
+
+    while (capacity < size)
+        capacity *= 2;
+
+    atomicmapTable* table = malloc(sizeof(atomicmapTable));
+    table->size = capacity;
+    table->slots = malloc(capacity*sizeof(atomicmapSlot));
+    table->retiredNext = 0;
+
+    atomic_init(&table->claimed, 0);
+    atomic_init(&table->next, 0);
+    atomic_init(&table->copyAt, 0);
+    atomic_init(&table->copied, 0);
+
+    for (int i = 0; i < capacity; i++) {
+        atomic_init(&table->slots[i].key, atomicmap_empty);
+        atomic_init(&table->slots[i].value, 0);
+    }
+
+    return table;
+}
+
+static inline void atomicmapTableFree (atomicmapTable* table) {
+    free(table->slots);
+    free(table);
+}
+
+static inline atomicintmap* atomicintmapInit (atomicintmap* map, int size) {
+    atomic_init(&map->table, atomicmapTableInit(size));
+    atomic_init(&map->epoch, 1);
+    atomic_init(&map->retired, 0);
+    mtx_init(&map->reclaimLock, mtx_plain);
+
+    map->stripes = aligned_alloc(_Alignof(atomicmapStripe), atomicmap_stripes*sizeof(atomicmapStripe));
+
+    for (int i = 0; i < atomicmap_stripes; i++) {
+        atomic_init(&map->stripes[i].active[0], 0);
+        atomic_init(&map->stripes[i].active[1], 0);
+    }
+
+    return map;
+}
+
+static inline atomicintmap* atomicintmapFree (atomicintmap* map) {
+    /*The current table links any newer*/
+    for (atomicmapTable* table = atomic_load(&map->table), *next; table; table = next) {
+        next = atomic_load(&table->next);
+        atomicmapTableFree(table);
+    }
+
+    for (atomicmapTable* table = atomic_load(&map->retired), *next; table; table = next) {
+        next = table->retiredNext;
+        atomicmapTableFree(table);
+    }
+
+    mtx_destroy(&map->reclaimLock);
+    free(map->stripes);
+
+    atomic_store(&map->table, 0);
+    atomic_store(&map->retired, 0);
+    map->stripes = 0;
+    return map;
+}
+
+static inline bool atomicmapPresent (uintptr_t value) {
+    return (value & atomicmap_reserved) == atomicmap_present;
+}
+
+/*==== Epochs ====*/
+
+/*The stripe of the calling thread*/
+static inline int atomicmapStripeOf (void) {
+    static _Atomic int threads;
+    static _Thread_local int stripe = -1;
+
+    if (stripe < 0)
+        stripe = atomic_fetch_add(&threads, 1) % atomicmap_stripes;
+
+    return stripe;
+}
+
+/*Counts the thread as inside the current epoch, which is returned*/
+static inline uint64_t atomicmapEnter (atomicintmap* map, int stripe) {
+    for (;;) {
+        uint64_t epoch = atomic_load(&map->epoch);
+        atomic_fetch_add(&map->stripes[stripe].active[epoch & 1], 1);
+
+        /*Only counted if the epoch hasn't moved on meanwhile*/
+        if (atomic_load(&map->epoch) == epoch)
+            return epoch;
+
+        atomic_fetch_sub(&map->stripes[stripe].active[epoch & 1], 1);
+    }
+}
+
+static inline void atomicmapExit (atomicintmap* map, int stripe, uint64_t epoch) {
+    atomic_fetch_sub(&map->stripes[stripe].active[epoch & 1], 1);
+}
+
+static inline void atomicmapRetirePush (atomicintmap* map, atomicmapTable* table) {
+    table->retiredNext = atomic_load(&map->retired);
+
+    while (!atomic_compare_exchange_weak(&map->retired, &table->retiredNext, table))
+        ;
+}
+
+/*Moves the epoch on, if every thread has left the one before, and frees
+  the tables replaced two epochs ago, which no thread can still be in.
+  Gives up rather than wait for another thread doing so.*/
+static inline void atomicmapReclaim (atomicintmap* map) {
+    if (!atomic_load(&map->retired) || mtx_trylock(&map->reclaimLock) != thrd_success)
+        return;
+
+    uint64_t epoch = atomic_load(&map->epoch);
+    int before = 0;
+
+    /*The epoch before shares a parity with the one after*/
+    for (int i = 0; i < atomicmap_stripes; i++)
+        before += atomic_load(&map->stripes[i].active[(epoch+1) & 1]);
+
+    if (!before && atomic_compare_exchange_strong(&map->epoch, &epoch, epoch+1))
+        epoch++;
+
+    for (atomicmapTable* table = atomic_exchange(&map->retired, 0), *next; table; table = next) {
+        next = table->retiredNext;
+
+        if (table->retiredIn + 2 <= epoch)
+            atomicmapTableFree(table);
+
+        else
+            atomicmapRetirePush(map, table);
+    }
+
+    mtx_unlock(&map->reclaimLock);
+}
+
+/*==== Tables ====*/
+
+/*Big enough that the live entries fill 3/8 of it, half the limit*/
+static inline int atomicmapSizeFor (int live) {
+    int size = 4;
+
+    while (size*3 < live*8)
+        size *= 2;
+
+    return size;
+}
+
+/*Links a successor for a table found to be full, if no one else has,
+  and returns it*/
+static inline atomicmapTable* atomicmapGrow (atomicmapTable* table) {
+    atomicmapTable* next = atomic_load(&table->next);
+
+    if (next)
+        return next;
+
+    /*Counting is no dearer than the copy to come, and keeps the
+      writes from contending on a counter*/
+    int live = 0;
+
+    for (int i = 0; i < table->size; i++)
+        live += atomicmapPresent(atomic_load_explicit(&table->slots[i].value, memory_order_relaxed));
+
+    atomicmapTable* expected = 0;
+    next = atomicmapTableInit(atomicmapSizeFor(live));
+
+    if (!atomic_compare_exchange_strong(&table->next, &expected, next)) {
+        atomicmapTableFree(next);
+        return expected;
+    }
+
+    return next;
+}
+
+/*Returns the slot holding the key, or claims an empty one for it, or
+  null if there are none left. Keys are claimed even once a successor is
+  linked, so that a key is only ever written to a table after its slot
+  in the one before has been frozen.*/
+static inline atomicmapSlot* atomicmapClaim (atomicmapTable* table, intptr_t element) {
+    int mask = table->size-1;
+    int index = hashint(element) & mask;
+
+    for (int probe = 0; probe < table->size; probe++) {
+        atomicmapSlot* slot = &table->slots[(index + probe) & mask];
+        intptr_t key = atomic_load_explicit(&slot->key, memory_order_acquire);
+
+        /*On failure this loads whichever key won the slot*/
+        if (key == atomicmap_empty && atomic_compare_exchange_strong(&slot->key, &key, element)) {
+            /*Keep the load under 3/4*/
+            if ((atomic_fetch_add(&table->claimed, 1)+1)*4 > table->size*3)
+                atomicmapGrow(table);
+
+            return slot;
+        }
+
+        if (key == element)
+            return slot;
+    }
+
+    return 0;
+}
+
+/*The slot holding the key. Null if it isn't in the table, and, if the
+  table is full, sets full, as it may then be in the next.*/
+static inline atomicmapSlot* atomicmapFind (atomicmapTable* table, intptr_t element, bool* full) {
+    int mask = table->size-1;
+    int index = hashint(element) & mask;
+
+    for (int probe = 0; probe < table->size; probe++) {
+        atomicmapSlot* slot = &table->slots[(index + probe) & mask];
+        intptr_t key = atomic_load_explicit(&slot->key, memory_order_acquire);
+
+        if (key == element)
+            return slot;
+
+        else if (key == atomicmap_empty)
+            return 0;
+    }
+
+    *full = true;
+    return 0;
+}
+
+/*Replaces the table with its successor once every slot is copied, and
+  then that one with its own, if it's already done too*/
+static inline void atomicmapPromote (atomicintmap* map, atomicmapTable* table) {
+    while (atomic_load(&table->copied) == table->size) {
+        atomicmapTable* expected = table;
+        atomicmapTable* next = atomic_load(&table->next);
+
+        /*Only the oldest table can be replaced. If this isn't it yet,
+          whoever finishes that one will come on to this.*/
+        if (!atomic_compare_exchange_strong(&map->table, &expected, next))
+            return;
+
+        table->retiredIn = atomic_load(&map->epoch);
+        atomicmapRetirePush(map, table);
+        table = next;
+    }
+}
+
+static inline void atomicmapCopied (atomicintmap* map, atomicmapTable* table, int slots) {
+    if (slots && atomic_fetch_add(&table->copied, slots)+slots == table->size)
+        atomicmapPromote(map, table);
+}
+
+static bool atomicmapCopySlot (atomicintmap* map, atomicmapTable* table, atomicmapSlot* slot);
+
+/**
+ * Sets the value of a key, to a tombstone to remove it, returning the
+ * value replaced. With ifNull (as when copying a slot forward), only if
+ * the key has never had any value, in this table or any after.
+ */
+static inline uintptr_t atomicmapPut (atomicintmap* map, atomicmapTable* table, intptr_t element,
+                                      uintptr_t value, bool ifNull) {
+    for (;;) {
+        atomicmapSlot* slot = atomicmapClaim(table, element);
+
+        if (!slot) {
+            table = atomicmapGrow(table);
+            continue;
+        }
+
+        uintptr_t old = atomic_load(&slot->value);
+
+        /*Only change a table that isn't being copied*/
+        while (!(old & atomicmap_frozen) && !atomic_load(&table->next)) {
+            if (ifNull && old)
+                return old;
+
+            /*Removing what isn't there*/
+            else if (value == atomicmap_tombstone && !atomicmapPresent(old))
+                return old;
+
+            /*On failure this loads the new value*/
+            else if (atomic_compare_exchange_strong(&slot->value, &old, value))
+                return old;
+        }
+
+        /*Otherwise it's changed in the next, once this slot is there*/
+        atomicmapCopied(map, table, atomicmapCopySlot(map, table, slot));
+
+        /*It had a value here, so any copied forward is stale*/
+        if (ifNull && atomic_load(&slot->value) == atomicmap_copiedFull)
+            return atomicmap_copiedFull;
+
+        table = atomic_load(&table->next);
+    }
+}
+
+/*Freezes a slot and copies its value into the next table, or finishes
+  another thread doing so. Returns whether it was this call that marked
+  it copied, and so must count it: each slot is counted exactly once.*/
+static bool atomicmapCopySlot (atomicintmap* map, atomicmapTable* table, atomicmapSlot* slot) {
+    uintptr_t old = atomic_load(&slot->value);
+
+    for (;;) {
+        if (old == atomicmap_copiedEmpty || old == atomicmap_copiedFull)
+            return false;
+
+        /*Someone else froze it, but may not have finished*/
+        else if (old & atomicmap_frozen)
+            break;
+
+        /*Nothing to copy*/
+        else if (!atomicmapPresent(old)) {
+            uintptr_t copied = old ? atomicmap_copiedFull : atomicmap_copiedEmpty;
+
+            if (atomic_compare_exchange_strong(&slot->value, &old, copied))
+                return true;
+
+        } else if (atomic_compare_exchange_strong(&slot->value, &old, old | atomicmap_frozen)) {
+            old |= atomicmap_frozen;
+            break;
+        }
+    }
+
+    /*Any value already there in the next is newer*/
+    atomicmapPut(map, atomic_load(&table->next), atomic_load(&slot->key), old & ~atomicmap_frozen, true);
+
+    return atomic_compare_exchange_strong(&slot->value, &old, atomicmap_copiedFull);
+}
+
+/*Copies a chunk of a table being replaced. Once every chunk has been
+  taken, any slots that are still not done (a helper having stalled) are
+  done here, so no one need wait.*/
+static inline void atomicmapHelpCopy (atomicintmap* map, atomicmapTable* table) {
+    int start = atomic_load(&table->copyAt) < table->size
+              ? atomic_fetch_add(&table->copyAt, atomicmap_copy_slots)
+              : table->size;
+
+    int end = start + atomicmap_copy_slots;
+
+    if (start >= table->size) {
+        if (atomic_load(&table->copied) == table->size)
+            return;
+
+        start = 0;
+        end = table->size;
+
+    } else if (end > table->size)
+        end = table->size;
+
+    int copied = 0;
+
+    for (int i = start; i < end; i++)
+        copied += atomicmapCopySlot(map, table, &table->slots[i]);
+
+    atomicmapCopied(map, table, copied);
+}
+
+/*Sets a value from the top, helping copy any table being replaced*/
+static inline uintptr_t atomicmapSet (atomicintmap* map, intptr_t element, uintptr_t value) {
+    int stripe = atomicmapStripeOf();
+    uint64_t epoch = atomicmapEnter(map, stripe);
+
+    atomicmapTable* table = atomic_load(&map->table);
+
+    if (atomic_load(&table->next))
+        atomicmapHelpCopy(map, table);
+
+    uintptr_t old = atomicmapPut(map, table, element, value, false);
+
+    atomicmapExit(map, stripe, epoch);
+    atomicmapReclaim(map);
+    return old;
+}
+
+static inline int atomicintmapAdd (atomicintmap* map, intptr_t element, void* value) {
+    if (element == atomicmap_empty || (uintptr_t) value & atomicmap_reserved)
+        return -1;
+
+    return atomicmapPresent(atomicmapSet(map, element, (uintptr_t) value | atomicmap_present));
+}
+
+static inline bool atomicintmapRemove (atomicintmap* map, intptr_t element) {
+    /*Never added*/
+    if (element == atomicmap_empty)
+        return false;
+
+    return atomicmapPresent(atomicmapSet(map, element, atomicmap_tombstone));
+}
+
+static inline void* atomicintmapMap (atomicintmap* map, intptr_t element) {
+    /*Would match every empty slot*/
+    if (element == atomicmap_empty)
+        return 0;
+
+    int stripe = atomicmapStripeOf();
+    uint64_t epoch = atomicmapEnter(map, stripe);
+
+    atomicmapTable* table = atomic_load_explicit(&map->table, memory_order_acquire);
+    uintptr_t value = 0;
+
+    while (table) {
+        bool full = false;
+        atomicmapSlot* slot = atomicmapFind(table, element, &full);
+
+        /*A key only gets to the next table through a slot in this one,
+          unless this one is full*/
+        if (!slot) {
+            table = full ? atomic_load(&table->next) : 0;
+            continue;
+        }
+
+        value = atomic_load_explicit(&slot->value, memory_order_acquire);
+
+        /*A frozen value is still current, until it has been copied*/
+        if (value != atomicmap_copiedEmpty && value != atomicmap_copiedFull) {
+            value &= ~atomicmap_frozen;
+            break;
+        }
+
+        table = atomic_load(&table->next);
+        value = 0;
+    }
+
+    atomicmapExit(map, stripe, epoch);
+    return atomicmapPresent(value) ? (void*) (value & ~atomicmap_present) : 0;
+}
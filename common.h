@@ -33,7 +33,103 @@ typedef struct alloc_t {
     strdup_t strdup;
 } alloc_t;
 
-#define stdalloc ((alloc_t) {malloc, clear, free, realloc, strdup})
+#define stdalloc ((alloc_t) {malloc, calloc, free, realloc, strdup})
+
+/**
+ * An allocator that carries a context, such as an arena or a pool (see
+ * allocator.h for some). Each function is given the allocator itself,
+ * and so its context. free and realloc are also given the size that was
+ * allocated, so that allocators needn't keep it themselves.
+ *
+ * Structures that take one keep a copy (or a pointer, where noted), and
+ * so it must not change while they use it.
+ */
+typedef struct allocator allocator;
+
+struct allocator {
+    void* (*malloc)(const allocator* self, size_t size);
+    void* (*realloc)(const allocator* self, void* ptr, size_t oldSize, size_t size);
+    void (*free)(const allocator* self, void* ptr, size_t size);
+
+    union {
+        void* ctx;
+        /*allocatorFromCalloc*/
+        calloc_t calloc;
+    };
+};
+
+static inline void* allocatorStdMalloc (const allocator* self, size_t size) {
+    (void) self;
+    return malloc(size);
+}
+
+static inline void* allocatorStdRealloc (const allocator* self, void* ptr, size_t oldSize, size_t size) {
+    (void) self, (void) oldSize;
+    return realloc(ptr, size);
+}
+
+static inline void allocatorStdFree (const allocator* self, void* ptr, size_t size) {
+    (void) self, (void) size;
+    free(ptr);
+}
+
+#define stdallocator ((allocator) {allocatorStdMalloc, allocatorStdRealloc, allocatorStdFree, {0}})
+
+/*An alloc_t, which must outlive the allocator*/
+static inline void* allocatorPlainMalloc (const allocator* self, size_t size) {
+    return ((const alloc_t*) self->ctx)->malloc(size);
+}
+
+static inline void* allocatorPlainRealloc (const allocator* self, void* ptr, size_t oldSize, size_t size) {
+    (void) oldSize;
+    return ((const alloc_t*) self->ctx)->realloc(ptr, size);
+}
+
+static inline void allocatorPlainFree (const allocator* self, void* ptr, size_t size) {
+    (void) size;
+    ((const alloc_t*) self->ctx)->free(ptr);
+}
+
+static inline allocator allocatorFrom (const alloc_t* alloc) {
+    return (allocator) {allocatorPlainMalloc, allocatorPlainRealloc, allocatorPlainFree, {.ctx = (void*) alloc}};
+}
+
+/*Just a calloc, with the standard free and realloc*/
+static inline void* allocatorCallocMalloc (const allocator* self, size_t size) {
+    return self->calloc(1, size);
+}
+
+static inline allocator allocatorFromCalloc (calloc_t calloc) {
+    return (allocator) {allocatorCallocMalloc, allocatorStdRealloc, allocatorStdFree, {.calloc = calloc}};
+}
+
+static inline void* allocatorMalloc (const allocator* alloc, size_t size) {
+    return alloc->malloc(alloc, size);
+}
+
+/*Null if out of memory, or if the total size overflows, as calloc*/
+static inline void* allocatorCalloc (const allocator* alloc, size_t n, size_t size) {
+    if (size && n > SIZE_MAX/size)
+        return 0;
+
+    void* ptr = alloc->malloc(alloc, n*size);
+    return ptr ? memset(ptr, 0, n*size) : 0;
+}
+
+static inline void* allocatorRealloc (const allocator* alloc, void* ptr, size_t oldSize, size_t size) {
+    return alloc->realloc(alloc, ptr, oldSize, size);
+}
+
+/*Null is ignored, as by free*/
+static inline void allocatorFree (const allocator* alloc, void* ptr, size_t size) {
+    if (ptr)
+        alloc->free(alloc, ptr, size);
+}
+
+static inline char* allocatorStrdup (const allocator* alloc, const char* str) {
+    size_t size = strlen(str)+1;
+    return memcpy(allocatorMalloc(alloc, size), str, size);
+}
 
 static inline void* malloci (size_t size, const void* src) {
     void* obj = malloc(size);
@@ -132,14 +228,9 @@ static inline size_t strcatwith (char* buffer, size_t n, char** strs, const char
     return pos;
 }
 
-static inline char* strjoinwith (size_t n, char** strs, const char* separator, malloc_t malloc) {
-    if (n <= 0) {
-        char* str = malloc(1);
-        *str = 0;
-        return str;
-    }
-
-    /*Work out the length*/
+static inline size_t strjoinlength (size_t n, char** strs, const char* separator) {
+    if (n <= 0)
+        return 1;
 
     size_t length = 1;
     size_t seplength = strlen(separator);
@@ -148,10 +239,27 @@ static inline char* strjoinwith (size_t n, char** strs, const char* separator, m
     for (size_t i = 0; i < n; i++)
         length += strlen(strs[i]);
 
-    /*Make the string*/
+    return length;
+}
 
-    char* str = malloc(length);
-    strcatwith(str, n, strs, separator);
+static inline char* strjoinwith (size_t n, char** strs, const char* separator, malloc_t malloc) {
+    char* str = malloc(strjoinlength(n, strs, separator));
+    *str = 0;
+
+    if (n > 0)
+        strcatwith(str, n, strs, separator);
+
+    return str;
+}
+
+/*As strjoinwith, but the allocator is told the size, so it can be freed
+  with allocatorFree(alloc, str, strlen(str)+1)*/
+static inline char* strjoinwithAlloc (size_t n, char** strs, const char* separator, const allocator* alloc) {
+    char* str = allocatorMalloc(alloc, strjoinlength(n, strs, separator));
+    *str = 0;
+
+    if (n > 0)
+        strcatwith(str, n, strs, separator);
 
     return str;
 }
@@ -160,6 +268,10 @@ static inline char* strjoin (int n, char** strs, malloc_t malloc) {
     return strjoinwith(n, strs, "", malloc);
 }
 
+static inline char* strjoinAlloc (int n, char** strs, const allocator* alloc) {
+    return strjoinwithAlloc(n, strs, "", alloc);
+}
+
 /*strcat, resizing the buffer if need be*/
 static inline char* strrecat (char* dest, size_t* size, const char* src) {
     size_t destlength = strlen(dest);
@@ -177,6 +289,8 @@ static inline int qsort_cstr (const void* left, const void* right) {
     return strcmp(*(char**) left, *(char**) right);
 }
 
+/*Reads the rest of a file into a null terminated buffer. For a whole
+  file by name or descriptor, without the copying, see fileview.h*/
 static inline char* readall (FILE* file, alloc_t alloc) {
     size_t bufsize = 512;
     char* buffer = alloc.malloc(bufsize);
@@ -194,9 +308,7 @@ static inline char* readall (FILE* file, alloc_t alloc) {
             buffer = alloc.realloc(buffer, bufsize *= 2);
     }
 
-    if (pos >= bufsize)
-        buffer = alloc.realloc(buffer, bufsize += 1);
-
-    buffer[pos-1] = 0;
+    /*The last read fell short, so there is room for the terminator*/
+    buffer[pos] = 0;
     return buffer;
 }
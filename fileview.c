@@ -0,0 +1,145 @@
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+#include "fileview.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*Maps a regular file of a known, non-zero, size*/
+static staterr fileview_map (int fd, size_t size, fileview* result) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+
+    /*The kernel zeroes the rest of the last page, past the end of the
+      file, which terminates it. If the file fills its last page, the
+      null byte comes from an anonymous page mapped after it.*/
+    size_t mapped = size % pagesize ? size : size + pagesize;
+
+    char* data = mmap(0, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (data == MAP_FAILED)
+        return nicestat_error(errno);
+
+    /*Over the start of the reservation*/
+    if (mmap(data, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        int error = errno;
+        munmap(data, mapped);
+        return nicestat_error(error);
+    }
+
+    *result = (fileview) {.data = data, .length = size, .mapped = mapped};
+    return stat_success;
+}
+
+/*Reads until the end of the file, into a buffer of (at first) the
+  expected size*/
+static staterr fileview_read (int fd, size_t expected, fileview* result) {
+    /*Room for the terminator, and for the read that finds the end, so
+      that a file of the expected size takes one allocation*/
+    size_t capacity = expected ? expected+2 : 4096;
+    char* data = malloc(capacity);
+    size_t length = 0;
+
+    if (!data)
+        return staterr_nomemory;
+
+    for (;;) {
+        /*Keep room for the terminator*/
+        if (length+1 == capacity) {
+            char* grown = realloc(data, capacity *= 2);
+
+            if (!grown) {
+                free(data);
+                return staterr_nomemory;
+            }
+
+            data = grown;
+        }
+
+        ssize_t bytes = read(fd, data+length, capacity-1 - length);
+
+        if (bytes == 0)
+            break;
+
+        else if (bytes < 0 && errno == EINTR)
+            continue;
+
+        else if (bytes < 0) {
+            int error = errno;
+            free(data);
+            return nicestat_error(error);
+        }
+
+        length += bytes;
+    }
+
+    data[length] = 0;
+    *result = (fileview) {.data = data, .length = length};
+    return stat_success;
+}
+
+staterr fileviewOpenFd (int filedescriptor, fileview* result) {
+    stat_t st;
+    staterr error = nicefstat(filedescriptor, &st);
+
+    if (error)
+        return error;
+
+    /*Fall back to reading if it can't be mapped, e.g. on some filesystems*/
+    if (   st.mode == file_regular && st.size > 0
+        && fileview_map(filedescriptor, st.size, result) == stat_success)
+        return stat_success;
+
+    return fileview_read(filedescriptor, st.mode == file_regular ? st.size : 0, result);
+}
+
+staterr fileviewReadFd (int filedescriptor, fileview* result) {
+    stat_t st;
+    staterr error = nicefstat(filedescriptor, &st);
+
+    if (error)
+        return error;
+
+    if (st.mode != file_regular)
+        return fileview_read(filedescriptor, 0, result);
+
+    /*Have the kernel read ahead further, and start now*/
+    posix_fadvise(filedescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(filedescriptor, 0, 0, POSIX_FADV_WILLNEED);
+
+    return fileview_read(filedescriptor, st.size, result);
+}
+
+/*Opens a file, to view it one way or the other*/
+static staterr fileview_open (const char* filename, fileview* result,
+                              staterr (*view)(int filedescriptor, fileview* result)) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return nicestat_error(errno);
+
+    staterr error = view(fd, result);
+    close(fd);
+    return error;
+}
+
+staterr fileviewOpen (const char* filename, fileview* result) {
+    return fileview_open(filename, result, fileviewOpenFd);
+}
+
+staterr fileviewRead (const char* filename, fileview* result) {
+    return fileview_open(filename, result, fileviewReadFd);
+}
+
+void fileviewClose (fileview* view) {
+    if (view->mapped)
+        munmap((void*) view->data, view->mapped);
+
+    else
+        free((void*) view->data);
+
+    *view = (fileview) {0};
+}
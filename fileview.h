@@ -0,0 +1,71 @@
+#pragma once
+
+#include "nicestat.h"
+#include "vector.h"
+
+#include <stddef.h>
+
+/**
+ * A read-only view of the whole contents of a file, always followed by a
+ * null byte, so that it can be used as a string.
+ *
+ * Regular files are memory mapped, so loading one is an open, a stat and
+ * an mmap, however big it is, and its pages are only read in as they are
+ * touched. Anything else (pipes, FIFOs, terminals, and files like those in
+ * /proc whose size is given as 0) is read into one buffer instead.
+ *
+ * A mapped file that is truncated while in view will fault on access to
+ * the part that's gone, and changes to it by others may show through.
+ */
+
+typedef struct fileview {
+    /*The contents, and a null byte at data[length]*/
+    const char* data;
+    size_t length;
+    /*How much was mapped, or 0 if the contents were read into memory*/
+    size_t mapped;
+} fileview;
+
+staterr fileviewOpen (const char* filename, fileview* result);
+
+/*The descriptor is left open, and can be closed once this returns.
+  Non-regular files are read from their current position.*/
+staterr fileviewOpenFd (int filedescriptor, fileview* result);
+
+/**
+ * Reads the whole file into memory instead, with one allocation when its
+ * size is known up front (as it is for regular files), and tells the
+ * kernel it will be read sequentially. The copy is unaffected by later
+ * changes to the file, unlike a mapping.
+ */
+staterr fileviewRead (const char* filename, fileview* result);
+staterr fileviewReadFd (int filedescriptor, fileview* result);
+
+DEFINE_VECTOR(fileviewvector, fileview)
+
+/**
+ * Reads n files at once, each as fileviewRead would, into results[i],
+ * with its error, if any, in errors[i]. Returns how many failed, which
+ * are left empty.
+ *
+ * The opens, reads and closes are each submitted together, in batches,
+ * through io_uring, so they take a handful of system calls between them,
+ * besides an fstat each. Where io_uring isn't available, or the kernel
+ * predates the operations needed (5.6), the files are read by a pool of
+ * threads instead, the calling one included.
+ */
+int fileviewReadBatch (const char* const* filenames, int n,
+                       fileview* results, staterr* errors, int threads);
+
+/**
+ * As fileviewReadBatch, for a vector of names, returning their views in
+ * a vector of the same length. The errors go in errors[i], if it isn't
+ * null. Returns a null vector if it runs out of memory.
+ *
+ * Free with fileviewvectorFreeObjs(&views, fileviewClose).
+ */
+fileviewvector fileviewReadVector (vector(const char*) filenames,
+                                   staterr* errors, int threads);
+
+/*Releases the contents, however they were loaded*/
+void fileviewClose (fileview* view);
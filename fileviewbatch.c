@@ -0,0 +1,414 @@
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+#include "fileview.h"
+#include "threadrun.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*==== io_uring, through the raw system calls ====*/
+
+enum {
+    /*Submission slots, and so files per batch*/
+    uring_entries = 256
+};
+
+typedef struct uring {
+    int fd;
+    /*The rings, and where in them the kernel keeps each field*/
+    void *sq, *cq;
+    size_t sqSize, cqSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    struct io_uring_params params;
+    /*How many operations the last uring_run submitted. If it failed, those
+      queued after never reached the kernel.*/
+    unsigned submitted;
+} uring;
+
+/*A field of one of the rings, shared with the kernel*/
+#define uring_field(ring, offset) ((_Atomic unsigned*) ((char*) (ring) + (offset)))
+
+/*Whether the kernel knows every operation the batch uses. They came in
+  5.6, as did the probe, so a kernel that can't be probed has none.*/
+static bool uring_supported (int fd) {
+    static const int needed[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+    enum {ops = 256};
+
+    struct io_uring_probe* probe = calloc(1, sizeof(struct io_uring_probe)
+                                              + ops*sizeof(struct io_uring_probe_op));
+    bool supported = probe && !syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, ops);
+
+    for (size_t i = 0; supported && i < sizeof(needed)/sizeof(*needed); i++)
+        supported = needed[i] <= probe->last_op && probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED;
+
+    free(probe);
+    return supported;
+}
+
+static bool uring_init (uring* ring) {
+    *ring = (uring) {0};
+    ring->fd = syscall(__NR_io_uring_setup, uring_entries, &ring->params);
+
+    if (ring->fd < 0)
+        return false;
+
+    /*Better to read the whole batch with threads than any file serially*/
+    else if (!uring_supported(ring->fd)) {
+        close(ring->fd);
+        return false;
+    }
+
+    struct io_uring_params* p = &ring->params;
+    ring->sqSize = p->sq_off.array + p->sq_entries*sizeof(unsigned);
+    ring->cqSize = p->cq_off.cqes + p->cq_entries*sizeof(struct io_uring_cqe);
+    ring->sqesSize = p->sq_entries*sizeof(struct io_uring_sqe);
+
+    /*Both rings may share one mapping*/
+    if (p->features & IORING_FEAT_SINGLE_MMAP)
+        ring->sqSize = ring->cqSize = ring->sqSize > ring->cqSize ? ring->sqSize : ring->cqSize;
+
+    ring->sq = mmap(0, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQ_RING);
+
+    ring->cq = p->features & IORING_FEAT_SINGLE_MMAP
+             ? ring->sq
+             : mmap(0, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_CQ_RING);
+
+    ring->sqes = mmap(0, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+
+    if (ring->sq == MAP_FAILED || ring->cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq != MAP_FAILED) munmap(ring->sq, ring->sqSize);
+        if (ring->cq != MAP_FAILED && ring->cq != ring->sq) munmap(ring->cq, ring->cqSize);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesSize);
+        close(ring->fd);
+        return false;
+    }
+
+    return true;
+}
+
+static void uring_free (uring* ring) {
+    munmap(ring->sqes, ring->sqesSize);
+
+    if (ring->cq != ring->sq)
+        munmap(ring->cq, ring->cqSize);
+
+    munmap(ring->sq, ring->sqSize);
+    close(ring->fd);
+}
+
+/*Queues an operation, to be submitted by uring_run. There must be room.*/
+static struct io_uring_sqe* uring_queue (uring* ring, int op, uint64_t userdata) {
+    const struct io_sqring_offsets* off = &ring->params.sq_off;
+    unsigned tail = atomic_load_explicit(uring_field(ring->sq, off->tail), memory_order_relaxed);
+    unsigned index = tail & *uring_field(ring->sq, off->ring_mask);
+
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    *sqe = (struct io_uring_sqe) {.opcode = op, .user_data = userdata};
+
+    ((unsigned*) ((char*) ring->sq + off->array))[index] = index;
+    /*Publish it to the kernel*/
+    atomic_store_explicit(uring_field(ring->sq, off->tail), tail+1, memory_order_release);
+    return sqe;
+}
+
+typedef void (*uring_reaper)(uint64_t userdata, int result, void* ctx);
+
+/*Submits the n queued operations, and waits for and reaps all of them.
+  Returns false if the ring failed first, leaving the rest unreaped.*/
+static bool uring_run (uring* ring, unsigned n, uring_reaper reap, void* ctx) {
+    const struct io_cqring_offsets* off = &ring->params.cq_off;
+    unsigned reaped = 0;
+    ring->submitted = 0;
+
+    while (reaped < n) {
+        int entered = syscall(__NR_io_uring_enter, ring->fd, n - ring->submitted, n - reaped,
+                              IORING_ENTER_GETEVENTS, 0, 0);
+
+        /*Anything but being interrupted, or told to reap first. A failure
+          means none were submitted by that call.*/
+        if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+
+        ring->submitted += entered > 0 ? (unsigned) entered : 0;
+
+        unsigned head = atomic_load_explicit(uring_field(ring->cq, off->head), memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(uring_field(ring->cq, off->tail), memory_order_acquire);
+        unsigned mask = *uring_field(ring->cq, off->ring_mask);
+        struct io_uring_cqe* cqes = (struct io_uring_cqe*) ((char*) ring->cq + off->cqes);
+
+        for (; head != tail; head++, reaped++)
+            reap(cqes[head & mask].user_data, cqes[head & mask].res, ctx);
+
+        atomic_store_explicit(uring_field(ring->cq, off->head), head, memory_order_release);
+    }
+
+    return true;
+}
+
+/*==== The batch ====*/
+
+typedef struct fileviewBatch {
+    const char* const* filenames;
+    fileview* results;
+    staterr* errors;
+
+    /*Per file of the current batch. Also, where its operation is in the
+      queue, until it's reaped, or -1.*/
+    int fds[uring_entries];
+    int queuedAt[uring_entries];
+    /*The first file of the batch*/
+    int first;
+} fileviewBatch;
+
+enum {
+    /*The operation, in the low bits of the user data, with the file above*/
+    batch_open, batch_read, batch_close,
+    batch_opBits = 2
+};
+
+static void fileview_reap (uint64_t userdata, int result, void* ctx) {
+    fileviewBatch* batch = ctx;
+    int i = userdata >> batch_opBits;
+    int file = batch->first + i;
+    batch->queuedAt[i] = -1;
+
+    switch (userdata & ((1 << batch_opBits) - 1)) {
+    case batch_open:
+        batch->fds[i] = result;
+
+        if (result < 0)
+            batch->errors[file] = nicestat_error(-result);
+
+        break;
+
+    case batch_read:
+        /*Retry any that came up short (the file changed size) or failed,
+          the slow way, which also finds the error*/
+        if (result < 0 || (size_t) result != batch->results[file].length) {
+            fileviewClose(&batch->results[file]);
+            batch->errors[file] = fileviewReadFd(batch->fds[i], &batch->results[file]);
+        }
+
+        break;
+
+    case batch_close:
+        break;
+    }
+}
+
+/*Whether a file can be read in one go*/
+static bool fileview_batchable (const stat_t* st) {
+    /*Size 0 may be a file in /proc, which needs reading to the end*/
+    return st->mode == file_regular && st->size > 0 && st->size < INT32_MAX;
+}
+
+/*Whether a file's operation is still with the kernel, once the ring has
+  failed. It may yet be completed, so any buffer is left to it, and any
+  descriptor it was opening leaks.*/
+static bool fileview_inKernel (const uring* ring, const fileviewBatch* batch, int i) {
+    return batch->queuedAt[i] >= 0 && (unsigned) batch->queuedAt[i] < ring->submitted;
+}
+
+/*Returns how many files it got through, fewer than n if the ring failed*/
+static int fileview_readUring (uring* ring, fileviewBatch* batch, int n) {
+    for (batch->first = 0; batch->first < n; batch->first += uring_entries) {
+        int files = n - batch->first < uring_entries ? n - batch->first : uring_entries;
+        unsigned queued = 0;
+
+        /*Open them all at once*/
+        for (int i = 0; i < files; i++) {
+            const char* filename = batch->filenames[batch->first + i];
+            batch->errors[batch->first + i] = stat_success;
+            batch->results[batch->first + i] = (fileview) {0};
+            batch->fds[i] = -1;
+            batch->queuedAt[i] = queued++;
+
+            struct io_uring_sqe* sqe = uring_queue(ring, IORING_OP_OPENAT, i << batch_opBits | batch_open);
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t) filename;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        }
+
+        /*Leave the whole batch to be read again*/
+        if (!uring_run(ring, queued, fileview_reap, batch)) {
+            for (int i = 0; i < files; i++)
+                if (batch->fds[i] >= 0)
+                    close(batch->fds[i]);
+
+            return batch->first;
+        }
+
+        queued = 0;
+
+        /*Read each whole, into a buffer of its size. fstat is cheap once
+          a file is open, unlike a stat by name, which io_uring always hands
+          off to a worker thread.*/
+        for (int i = 0; i < files; i++) {
+            int file = batch->first + i;
+            stat_t st;
+
+            if (batch->fds[i] < 0)
+                continue;
+
+            /*Anything else is read as it would be on its own*/
+            else if (nicefstat(batch->fds[i], &st) || !fileview_batchable(&st)) {
+                batch->errors[file] = fileviewReadFd(batch->fds[i], &batch->results[file]);
+                continue;
+            }
+
+            size_t size = st.size;
+            char* data = malloc(size+1);
+
+            if (!data) {
+                batch->errors[file] = staterr_nomemory;
+                continue;
+            }
+
+            data[size] = 0;
+            batch->results[file] = (fileview) {.data = data, .length = size};
+            batch->queuedAt[i] = queued++;
+
+            struct io_uring_sqe* sqe = uring_queue(ring, IORING_OP_READ, i << batch_opBits | batch_read);
+            sqe->fd = batch->fds[i];
+            sqe->addr = (uintptr_t) data;
+            sqe->len = size;
+            sqe->off = 0;
+        }
+
+        /*Finish the reads from the descriptors*/
+        if (!uring_run(ring, queued, fileview_reap, batch)) {
+            for (int i = 0; i < files; i++) {
+                int file = batch->first + i;
+
+                if (batch->fds[i] < 0)
+                    continue;
+
+                else if (batch->queuedAt[i] >= 0) {
+                    if (fileview_inKernel(ring, batch, i))
+                        batch->results[file] = (fileview) {0};
+
+                    else
+                        fileviewClose(&batch->results[file]);
+
+                    batch->errors[file] = fileviewReadFd(batch->fds[i], &batch->results[file]);
+                }
+
+                close(batch->fds[i]);
+            }
+
+            return batch->first + files;
+        }
+
+        queued = 0;
+
+        for (int i = 0; i < files; i++) {
+            if (batch->fds[i] < 0)
+                continue;
+
+            batch->queuedAt[i] = queued++;
+
+            struct io_uring_sqe* sqe = uring_queue(ring, IORING_OP_CLOSE, i << batch_opBits | batch_close);
+            sqe->fd = batch->fds[i];
+        }
+
+        /*The files are read, so just close what the kernel wasn't given*/
+        if (!uring_run(ring, queued, fileview_reap, batch)) {
+            for (int i = 0; i < files; i++)
+                if (batch->queuedAt[i] >= 0 && !fileview_inKernel(ring, batch, i))
+                    close(batch->fds[i]);
+
+            return batch->first + files;
+        }
+    }
+
+    return n;
+}
+
+/*==== Fallback, a thread pool ====*/
+
+typedef struct fileviewPool {
+    const char* const* filenames;
+    fileview* results;
+    staterr* errors;
+    int n;
+    /*The next file to be taken by a thread*/
+    _Atomic int next;
+} fileviewPool;
+
+static int fileview_poolWorker (void* ctx) {
+    fileviewPool* pool = ctx;
+
+    for (int i; (i = atomic_fetch_add(&pool->next, 1)) < pool->n;) {
+        pool->results[i] = (fileview) {0};
+        pool->errors[i] = fileviewRead(pool->filenames[i], &pool->results[i]);
+    }
+
+    return 0;
+}
+
+int fileviewReadBatch (const char* const* filenames, int n, fileview* results, staterr* errors,
+                       int threads) {
+    uring ring;
+    int done = 0;
+
+    if (uring_init(&ring)) {
+        fileviewBatch* batch = malloc(sizeof(fileviewBatch));
+
+        if (batch) {
+            *batch = (fileviewBatch) {.filenames = filenames, .results = results, .errors = errors};
+            done = fileview_readUring(&ring, batch, n);
+            free(batch);
+        }
+
+        uring_free(&ring);
+    }
+
+    /*Whatever the ring didn't get to*/
+    if (done < n) {
+        fileviewPool pool = {
+            .filenames = filenames + done, .results = results + done, .errors = errors + done,
+            .n = n - done
+        };
+
+        /*No more threads than files*/
+        threadrun(threads < pool.n ? threads : pool.n, fileview_poolWorker, &pool);
+    }
+
+    int failed = 0;
+
+    for (int i = 0; i < n; i++)
+        failed += errors[i] != stat_success;
+
+    return failed;
+}
+
+fileviewvector fileviewReadVector (vector(const char*) filenames, staterr* errors, int threads) {
+    fileviewvector views = fileviewvectorInit(filenames.length, malloc);
+    staterr* owned = errors ? 0 : malloc((filenames.length ? filenames.length : 1)*sizeof(staterr));
+
+    if (!views.buffer || (!errors && !owned)) {
+        fileviewvectorFree(&views);
+        free(owned);
+        return views;
+    }
+
+    views.length = filenames.length;
+    fileviewReadBatch((const char* const*) filenames.buffer, filenames.length, views.buffer,
+                      errors ? errors : owned, threads);
+
+    free(owned);
+    return views;
+}
@@ -3,6 +3,7 @@
 #include "common.h"
 
 #include <stdint.h>
+#include <limits.h>
 
 /**
  * This header provides 4 different data structures.
@@ -30,14 +31,69 @@
  *  - hashXXXMerge uses the same string keys in the destination as in the source.
  *  - Use hashXXXMergeDup to instead make a copy of each added to the dest.
  *  - Both will use the same void* value.
+ * and
+ *  - XXXRemove does not free the key or value it removes, look them up first
+ *    if they need to be.
+ *
+ * All of a map's own memory comes from the allocator it was made with,
+ * including when it grows: the calloc given to XXXInit (freed with the
+ * standard free), or the allocator given to XXXInitAlloc.
+ *
+ * Any key and any value may be stored, including null values and the int
+ * key 0. XXXmapMap returns null for a missing key as well as for a null
+ * value; use XXXmapTryGet if these need to be told apart.
  */
 
+/**
+ * How a map lays out its slots in memory:
+ *  - maplayout_split keeps keys, hashes and values in separate arrays.
+ *    Scanning only the keys or values (e.g. FreeObjs) stays compact.
+ *  - maplayout_packed interleaves the key, hash and value of each slot,
+ *    so a probe touches one cache line instead of three. Better for
+ *    large tables that are mostly looked up.
+ *  - maplayout_grouped packs slots as above. Lookups compare a group of
+ *    16 control bytes (see below) at once, with SSE2 or SWAR elsewhere,
+ *    and only compare the keys that match, so misses rarely touch a key
+ *    at all. Removals leave tombstones, cleared when the map is next
+ *    resized.
+ *
+ * Every layout also keeps a control byte per slot, which marks it empty,
+ * or holds 7 bits of the hash of its key.
+ */
+typedef enum maplayout {
+    maplayout_split, maplayout_packed, maplayout_grouped
+} maplayout;
+
+typedef struct generalmapSlot {
+    union {
+        const char* keyStr;
+        char* keyStrMutable;
+        intptr_t keyInt;
+    };
+    uint64_t hash;
+    void* value;
+} generalmapSlot;
+
 /**
  * An efficient data structure for mapping from null terminated keys
  * to void* values.
  */
 typedef struct generalmap {
     int size, elements;
+    /*The fraction of slots that may be used before it grows*/
+    float maxLoad;
+    /*The furthest any element has been placed from its first choice
+      slot. An upper bound only, removals don't lower it.*/
+    int maxProbe;
+    maplayout layout;
+    /*maplayout_grouped: removed slots not yet reclaimed*/
+    int tombstones;
+    /*Incremental resizing: the table still being migrated from, if any,
+      and the next of its slots to migrate*/
+    bool incremental;
+    struct generalmap* old;
+    int migrateAt;
+    /*maplayout_split*/
     union {
         const char** keysStr;
         /*We don't know whether the user intends the map to take ownership of
@@ -45,8 +101,16 @@ typedef struct generalmap {
         char** keysStrMutable;
         intptr_t* keysInt;
     };
-    int* hashes;
+    /*Full hashes, unmasked, only for maps with a cmp*/
+    uint64_t* hashes;
     void** values;
+    /*maplayout_packed and maplayout_grouped*/
+    generalmapSlot* slots;
+    /*All layouts*/
+    uint8_t* ctrl;
+    /*Every allocation of the map's own memory uses this, including
+      when it grows, as does MergeDup for the keys it copies*/
+    allocator alloc;
 } generalmap;
 
 typedef generalmap hashmap;
@@ -61,12 +125,55 @@ typedef generalmap intset;
 
 static bool mapNull (generalmap map);
 
+/**
+ * The bytes allocated for the table(s) of a map, not counting the
+ * struct itself, nor the keys and values.
+ */
+static size_t mapMemory (const generalmap* map);
+
+/**
+ * Normally a map that needs to grow moves every element into a new
+ * table then and there. An incremental map keeps the old table around
+ * instead, and each later add or remove moves a few more elements over.
+ * Lookups check both. This bounds the latency of any one operation,
+ * at the cost of slightly slower lookups while migration is underway.
+ */
+static void mapSetIncremental (generalmap* map, bool incremental);
+
+/**
+ * Make room for at least this many elements in total, so that adding
+ * up to that many will not resize.
+ */
+static void mapReserve (generalmap* map, int elements);
+
+/**
+ * Resize to the smallest table that holds the current elements,
+ * e.g. after removing many of them.
+ */
+static void mapShrinkToFit (generalmap* map);
+
+/**
+ * The fraction of slots that may be filled before the map grows,
+ * strictly between 0 and 1, by default 0.5. Higher saves memory, lower
+ * shortens probes. The grouped layout copes with higher loads (~0.875)
+ * much better than the others.
+ */
+static void mapSetMaxLoad (generalmap* map, float maxLoad);
+
+/**
+ * A copy of a map, using the same keys and values. Copies the table
+ * directly, so no key is hashed or compared.
+ */
+static generalmap mapDup (const generalmap* map);
+
 /*==== hashmap ====*/
 
 typedef void (*hashmapKeyDtor)(char* key, const void* value);
 typedef void (*hashmapValueDtor)(void* value);
 
 static hashmap hashmapInit (int size, calloc_t calloc);
+static hashmap hashmapInitLayout (int size, calloc_t calloc, maplayout layout);
+static hashmap hashmapInitAlloc (int size, allocator alloc, maplayout layout);
 
 static hashmap* hashmapFree (hashmap* map);
 static hashmap* hashmapFreeObjs (hashmap* map, hashmapKeyDtor keyDtor, hashmapValueDtor valueDtor);
@@ -77,11 +184,23 @@ static void hashmapMergeDup (hashmap* dest, const hashmap* src);
 
 static void* hashmapMap (const hashmap* map, const char* key);
 
+/*Returns whether the key is present, and if so stores its value*/
+static bool hashmapTryGet (const hashmap* map, const char* key, void** value);
+
+/*Maps n keys at once into values, which is faster for more than a
+  few as the memory accesses overlap*/
+static void hashmapMapBatch (const hashmap* map, const char** keys, int n, void** values);
+
+/*Returns whether the key was present*/
+static bool hashmapRemove (hashmap* map, const char* key);
+
 /*==== intmap ====*/
 
 typedef void (*intmapValueDtor)(void* value, int key);
 
 static intmap intmapInit (int size, calloc_t calloc);
+static intmap intmapInitLayout (int size, calloc_t calloc, maplayout layout);
+static intmap intmapInitAlloc (int size, allocator alloc, maplayout layout);
 
 static intmap* intmapFree (intmap* map);
 static intmap* intmapFreeObjs (intmap* map, intmapValueDtor dtor);
@@ -90,12 +209,18 @@ static bool intmapAdd (intmap* map, intptr_t element, void* value);
 static void intmapMerge (intmap* dest, const intmap* src);
 
 static void* intmapMap (const intmap* map, intptr_t element);
+static bool intmapTryGet (const intmap* map, intptr_t element, void** value);
+static void intmapMapBatch (const intmap* map, const intptr_t* elements, int n, void** values);
+
+static bool intmapRemove (intmap* map, intptr_t element);
 
 /*==== hashset ====*/
 
 typedef void (*hashsetDtor)(char* element);
 
 static hashset hashsetInit (int size, calloc_t calloc);
+static hashset hashsetInitLayout (int size, calloc_t calloc, maplayout layout);
+static hashset hashsetInitAlloc (int size, allocator alloc, maplayout layout);
 
 static hashset* hashsetFree (hashset* set);
 static hashset* hashsetFreeObjs (hashset* set, hashsetDtor dtor);
@@ -105,16 +230,59 @@ static void hashsetMerge (hashset* dest, hashset* src);
 static void hashsetMergeDup (hashset* dest, const hashset* src);
 
 static bool hashsetTest (const hashset* set, const char* element);
+static void hashsetTestBatch (const hashset* set, const char** elements, int n, bool* results);
+
+static bool hashsetRemove (hashset* set, const char* element);
 
 /*==== intset ====*/
 
 static intset intsetInit (int size, calloc_t calloc);
+static intset intsetInitLayout (int size, calloc_t calloc, maplayout layout);
+static intset intsetInitAlloc (int size, allocator alloc, maplayout layout);
 static intset* intsetFree (intset* set);
 
 static bool intsetAdd (intset* set, intptr_t element);
 static void intsetMerge (intset* dest, const intset* src);
 
 static bool intsetTest (const intset* set, intptr_t element);
+static void intsetTestBatch (const intset* set, const intptr_t* elements, int n, bool* results);
+
+static bool intsetRemove (intset* set, intptr_t element);
+
+/*==== Typed maps ====*/
+
+/**
+ * Define a map from keys of type K to values of type V, both stored
+ * inline in its slots, for name a new typedef, e.g.
+ *
+ *   DEFINE_MAP(wordcounts, const char*, int, hashstr, eqstr)
+ *
+ * hash, uint64_t (K), and eq, bool (K, K), are called directly rather
+ * than through function pointers as with generalmap, so they can be
+ * inlined into the probe loop. hashint and eqint suit integer keys,
+ * hashstr and eqstr strings.
+ *
+ * It works as the grouped layout: control bytes compared 16 at a time,
+ * and tombstones on removal. Maps grow at 7/8 full.
+ *
+ * The functions are prefixed by the name:
+ *   nameInit (size), nameInitAlloc (size, allocator), nameFree,
+ *   nameAdd, nameRemove (both returning whether the key was present),
+ *   nameMap (the value, or a zeroed V), nameTryGet, nameTest,
+ *   nameGet (a pointer to the value in place, or null, valid until the
+ *   next add or remove),
+ *   nameNext (the slot after the one given, or the first if given null,
+ *   or null at the end) to iterate, as in
+ *
+ *   for (wordcountsSlot* slot = 0; (slot = wordcountsNext(&map, slot));)
+ *       printf("%s %d\n", slot->key, slot->value);
+ *
+ * As with hashmap, it never frees what the keys or values point to.
+ */
+#define DEFINE_MAP(name, K, V, hash, eq) DEFINE_MAP__(name, K, V, hash, eq)
+
+static bool eqint (intptr_t left, intptr_t right);
+static bool eqstr (const char* left, const char* right);
 
 /*==== Inline implementations ====*/
 
@@ -122,21 +290,49 @@ static bool intsetTest (const intset* set, intptr_t element);
 #include "string.h"
 #include "assert.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 static inline bool mapNull (generalmap map) {
     return map.elements == 0;
 }
 
-static intptr_t hashstr (const char* key, int mapsize);
-static intptr_t hashint (intptr_t element, int mapsize);
+static inline size_t mapMemory (const generalmap* map) {
+    size_t slot = map->layout != maplayout_split
+                ? sizeof(generalmapSlot)
+                : sizeof(intptr_t) + sizeof(void*) + (map->hashes ? sizeof(uint64_t) : 0);
+
+    /*And a control byte each*/
+    size_t memory = map->size*(slot + 1);
+
+    if (map->old)
+        memory += sizeof(generalmap) + mapMemory(map->old);
+
+    return memory;
+}
+
+static inline void mapSetIncremental (generalmap* map, bool incremental) {
+    /*Any migration underway will still be finished off*/
+    map->incremental = incremental;
+}
+
+/*A 64-bit hash of arbitrary bytes*/
+static uint64_t hashbytes (const void* key, size_t length);
+
+/*Full 64-bit hashes, which maps mask down to their size themselves.
+  hashstrn is for strings whose length is already known.*/
+static uint64_t hashstr (const char* key);
+static uint64_t hashstrn (const char* key, size_t length);
+static uint64_t hashint (intptr_t element);
 
 typedef void (*generalmapKeyDtor)(char* key, const void* value);
 typedef void (*generalmapValueDtor)(void* value);
-typedef intptr_t (*generalmapHash)(const char* key, int mapsize);
+typedef uint64_t (*generalmapHash)(const char* key);
 //Like strcmp, returns 0 for match
 typedef int (*generalmapCmp)(const char* actual, const char* key);
-typedef char* (*generalmapDup)(const char* key);
 
-static generalmap generalmapInit (int size, calloc_t calloc, bool hashes);
+static generalmap generalmapInit (int size, allocator alloc, bool hashes, maplayout layout);
 
 static generalmap* generalmapFree (generalmap* map, bool hashes);
 static generalmap* generalmapFreeObjs (generalmap* map, generalmapKeyDtor keyDtor, generalmapValueDtor valueDtor,
@@ -145,63 +341,241 @@ static generalmap* generalmapFreeObjs (generalmap* map, generalmapKeyDtor keyDto
 static bool generalmapAdd (generalmap* map, const char* key, void* value,
                            generalmapHash hashf, generalmapCmp cmp, bool values);
 static void generalmapMerge (generalmap* dest, const generalmap* src,
-                             generalmapHash hash, generalmapCmp cmp, generalmapDup dup, bool values);
+                             generalmapHash hash, generalmapCmp cmp, bool dup, bool values);
 
 static void* generalmapMap (const generalmap* map, const char* key, generalmapHash hashf, generalmapCmp cmp);
 static bool generalmapTest (const generalmap* map, const char* key, generalmapHash hashf, generalmapCmp cmp);
+static bool generalmapTryGet (const generalmap* map, const char* key, void** value,
+                              generalmapHash hashf, generalmapCmp cmp);
+
+/*Looks up n keys, storing into either or both of values and results*/
+static void generalmapBatch (const generalmap* map, const char* const* keys, int n,
+                             void** values, bool* results, generalmapHash hashf, generalmapCmp cmp);
+
+static bool generalmapRemove (generalmap* map, const char* key, generalmapHash hashf, generalmapCmp cmp);
 
 /*==== Hash functions ====*/
 
-static inline intptr_t hashstr (const char* key, int mapsize) {
-    /*Jenkin's One-at-a-Time Hash
-      Taken from http://www.burtleburtle.net/bob/hash/doobs.html
-      Public domain*/
+/*Multiply into 128 bits, returning the two halves in place*/
+static inline void hashmum (uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t) *a * *b;
+    *a = (uint64_t) r;
+    *b = (uint64_t) (r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t carry = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    carry += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t hashmix (uint64_t a, uint64_t b) {
+    hashmum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t hashread8 (const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hashread4 (const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hashbytes (const void* key, size_t length) {
+    /*wyhash (final version 4) by Wang Yi
+      Adapted from https://github.com/wangyi-fudan/wyhash
+      Public domain (The Unlicense)
+
+      Reads 8 bytes at a time, 48 at a time in three independent lanes
+      for long keys. Keys of up to 16 bytes take no loop at all.*/
+
+    const uint64_t s0 = 0xa0761d6478bd642full, s1 = 0xe7037ed1a0b428dbull,
+                   s2 = 0x8ebc6af09c88c6e3ull, s3 = 0x589965cc75374cc3ull;
 
-    intptr_t hash = 0;
+    const uint8_t* p = key;
+    uint64_t seed = hashmix(s0, s1);
+    uint64_t a, b;
 
-    for (int i = 0; key[i]; i++) {
-        hash += key[i];
-        hash += hash << 10;
-        hash ^= hash >> 6;
+    if (length <= 16) {
+        if (length >= 4) {
+            /*Two overlapping reads from each end*/
+            size_t mid = (length >> 3) << 2;
+            a = hashread4(p) << 32 | hashread4(p + mid);
+            b = hashread4(p + length-4) << 32 | hashread4(p + length-4 - mid);
+
+        } else if (length > 0) {
+            a = (uint64_t) p[0] << 16 | (uint64_t) p[length >> 1] << 8 | p[length-1];
+            b = 0;
+
+        } else
+            a = b = 0;
+
+    } else {
+        size_t i = length;
+
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+
+            do {
+                seed = hashmix(hashread8(p) ^ s1, hashread8(p+8) ^ seed);
+                seed1 = hashmix(hashread8(p+16) ^ s2, hashread8(p+24) ^ seed1);
+                seed2 = hashmix(hashread8(p+32) ^ s3, hashread8(p+40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+
+            seed ^= seed1 ^ seed2;
+        }
+
+        for (; i > 16; i -= 16, p += 16)
+            seed = hashmix(hashread8(p) ^ s1, hashread8(p+8) ^ seed);
+
+        /*The last 16 bytes, overlapping what's been read if need be*/
+        a = hashread8(p + i-16);
+        b = hashread8(p + i-8);
     }
 
-    hash += hash << 3;
-    hash ^= hash >> 11;
-    hash += hash << 15;
+    a ^= s1;
+    b ^= seed;
+    hashmum(&a, &b);
+    return hashmix(a ^ s0 ^ length, b ^ s1);
+}
+
+static inline uint64_t hashstr (const char* key) {
+    /*strlen is itself vectorized, so find the length first and then
+      hash a word at a time*/
+    return hashstrn(key, strlen(key));
+}
 
-    /*Assumes mapsize is a power of two*/
-    intptr_t mask = mapsize-1;
-    return hash & mask;
+static inline uint64_t hashstrn (const char* key, size_t length) {
+    return hashbytes(key, length);
 }
 
-static inline intptr_t hashint (intptr_t element, int mapsize) {
-    /*The above, for a single value*/
+static inline uint64_t hashint (intptr_t element) {
+    /*A single wyhash mix, so that the high bits (used by the grouped
+      layout's tags) are as good as the low*/
+    return hashmix((uint64_t) element ^ 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull);
+}
 
-    intptr_t hash = element;
-    hash += hash << 10;
-    hash ^= hash >> 6;
-    hash += hash << 3;
-    hash ^= hash >> 11;
-    hash += hash << 15;
+static inline bool eqint (intptr_t left, intptr_t right) {
+    return left == right;
+}
 
-    intptr_t mask = mapsize-1;
-    return hash & mask;
+static inline bool eqstr (const char* left, const char* right) {
+    return !strcmp(left, right);
 }
 
 /*==== generalmap ====*/
 
-static bool generalmapIsMatch (const generalmap* map, int index, const char* key, int hash, generalmapCmp cmp);
+/*intmaps and intsets store their keys as if they were strings*/
+static inline uint64_t generalmapHashInt (const char* key) {
+    return hashint((intptr_t) key);
+}
+
+/*Slot accessors, independent of the layout. Hashes are only stored
+  for maps with a cmp.*/
+static const char* generalmapKeyAt (const generalmap* map, int index);
+static uint64_t generalmapHashAt (const generalmap* map, int index);
+static void* generalmapValueAt (const generalmap* map, int index);
+
+static void generalmapSetAt (generalmap* map, int index, const char* key, uint64_t hash, void* value);
+static void generalmapSetValueAt (generalmap* map, int index, void* value);
+
+static bool generalmapOccupied (const generalmap* map, int index);
+/*Empty a slot of a linear probing layout*/
+static void generalmapClearAt (generalmap* map, int index);
+
+/*The full hash of the key in a slot, from storage if the map keeps them*/
+static uint64_t generalmapSlotHash (const generalmap* map, int index, generalmapHash hashf);
+
+static bool generalmapIsMatch (const generalmap* map, int index, const char* key, uint64_t hash, generalmapCmp cmp);
+
+/*Add, TryGet and Remove with the hash of the key already known, e.g.
+  computed outside of a lock. hashf is still needed to resize int maps.*/
+static bool generalmapAddHashed (generalmap* map, const char* key, uint64_t hash, void* value,
+                                 generalmapHash hashf, generalmapCmp cmp, bool values);
+static bool generalmapTryGetHashed (const generalmap* map, const char* key, uint64_t hash,
+                                    void** value, generalmapCmp cmp);
+static bool generalmapRemoveHashed (generalmap* map, const char* key, uint64_t hash,
+                                    generalmapHash hashf, generalmapCmp cmp);
+
+/*Places a key known not to be present*/
+static int generalmapInsert (generalmap* map, const char* key, uint64_t hash, void* value);
 
-/*Slightly counterintuitively, this doesn't actually find the location
-  of the key. It finds the location where it stopped looking, which
-  will be:
-    1. The key
-    2. The first zero after its expected position
-    3. Another key, indicating that it was not found and that the
-       buffer is full
-  It is guaranteed to be a valid index in the buffer.*/
+/*Finds which of the current and old tables hold the key, if either,
+  and where*/
+static const generalmap* generalmapLocate (const generalmap* map, const char* key,
+                                           uint64_t hash, generalmapCmp cmp, int* index);
+
+/*Removes a key known to be in the table at the index*/
+static void generalmapRemoveAt (generalmap* map, int index, generalmapHash hashf);
+
+/*How many elements a table of the given size may hold, and the
+  smallest table that holds so many*/
+static int generalmapCapacity (const generalmap* map, int size);
+static int generalmapSizeFor (const generalmap* map, int elements);
+
+/*An empty table, but with the same settings*/
+static generalmap generalmapInitLike (const generalmap* map, int size);
+
+/*Moves every element into a new table of the given size, reusing the
+  stored hashes so that no key is looked at*/
+static void generalmapResize (generalmap* map, int size, generalmapHash hashf);
+
+/*Resizes now, or starts migrating to a new table if the map is incremental*/
+static void generalmapGrow (generalmap* map, int size, generalmapHash hashf);
+
+enum {
+    /*At least twice the slots per add as the table has elements to
+      insert before it next needs to grow*/
+    mapmigrate_slots = 8
+};
+
+/*Migrates elements from at least this many slots of the old table,
+  freeing it when it is empty*/
+static void generalmapMigrate (generalmap* map, int slots, generalmapHash hashf);
+
+/*Returns the index of the key, or -1 if it is not present. Gives up
+  after maxProbe slots even if it hasn't reached an empty one.*/
 static int generalmapFind (const generalmap* map, const char* key,
-                           int hash, generalmapCmp cmp);
+                           uint64_t hash, generalmapCmp cmp);
+
+/*Returns the first empty slot at or after the hash, and how far it is
+  from it. Requires that there be one.*/
+static int generalmapFindEmpty (const generalmap* map, uint64_t hash, int* distance);
+
+/*==== maplayout_grouped ====*/
+
+/*A control byte is either one of these, or the top 7 bits of the hash
+  of a present slot*/
+enum {
+    mapctrl_empty = 0x80,
+    mapctrl_deleted = 0xFE,
+    mapgroup_width = 16
+};
+
+/*Bitmasks of the slots in a group (bit n for slot n) whose control
+  byte is the given tag, or mapctrl_empty. The former may have false
+  positives, the latter won't.*/
+static unsigned generalmapGroupMatch (const uint8_t* ctrl, uint8_t tag);
+static unsigned generalmapGroupEmpty (const uint8_t* ctrl);
+static unsigned generalmapGroupEmptyOrDeleted (const uint8_t* ctrl);
+
+static int generalmapFindGrouped (const generalmap* map, const char* key,
+                                  uint64_t hash, generalmapCmp cmp);
+/*Finds an empty or deleted slot, distance being in groups*/
+static int generalmapFindEmptyGrouped (const generalmap* map, uint64_t hash, int* distance);
+static void generalmapRemoveGrouped (generalmap* map, int index);
 
 static inline int pow2ize (int x) {
     assert(sizeof(x) <= 8);
@@ -217,30 +591,65 @@ static inline int pow2ize (int x) {
     return x+1;
 }
 
-static inline generalmap generalmapInit (int size, calloc_t calloc, bool hashes) {
+static inline generalmap generalmapInit (int size, allocator alloc, bool hashes, maplayout layout) {
     /*The hash requires that the size is a power of two*/
     size = pow2ize(size);
 
-    return (generalmap) {
+    /*And the grouped layout that it be a whole number of groups*/
+    if (layout == maplayout_grouped && size < mapgroup_width)
+        size = mapgroup_width;
+
+    generalmap map = {
         .size = size,
         .elements = 0,
-        .keysInt = calloc(size, sizeof(intptr_t)),
-        .hashes = hashes ? calloc(size, sizeof(int)) : 0,
-        .values = calloc(size, sizeof(void*))
+        .maxLoad = 0.5,
+        .maxProbe = 0,
+        .layout = layout,
+        .alloc = alloc
     };
+
+    if (layout != maplayout_split)
+        map.slots = allocatorCalloc(&alloc, size, sizeof(generalmapSlot));
+
+    else {
+        map.keysInt = allocatorCalloc(&alloc, size, sizeof(intptr_t));
+        map.hashes = hashes ? allocatorCalloc(&alloc, size, sizeof(uint64_t)) : 0;
+        map.values = allocatorCalloc(&alloc, size, sizeof(void*));
+    }
+
+    map.ctrl = allocatorMalloc(&alloc, size);
+    memset(map.ctrl, mapctrl_empty, size);
+
+    return map;
 }
 
 static inline generalmap* generalmapFree (generalmap* map, bool hashes) {
-    free(map->keysInt);
+    const allocator* alloc = &map->alloc;
+    size_t size = map->size;
+
+    /*Nothing was allocated for a null map*/
+    if (map->ctrl) {
+        allocatorFree(alloc, map->keysInt, size*sizeof(intptr_t));
 
-    if (hashes)
-        free(map->hashes);
+        if (hashes)
+            allocatorFree(alloc, map->hashes, size*sizeof(uint64_t));
 
-    free(map->values);
+        allocatorFree(alloc, map->values, size*sizeof(void*));
+        allocatorFree(alloc, map->slots, size*sizeof(generalmapSlot));
+        allocatorFree(alloc, map->ctrl, size);
+    }
+
+    if (map->old) {
+        generalmapFree(map->old, hashes);
+        allocatorFree(alloc, map->old, sizeof(generalmap));
+        map->old = 0;
+    }
 
     map->keysInt = 0;
     map->hashes = 0;
     map->values = 0;
+    map->slots = 0;
+    map->ctrl = 0;
     return map;
 }
 
@@ -249,115 +658,661 @@ static inline generalmap* generalmapFreeObjs (generalmap* map, generalmapKeyDtor
     /*Until the end of the buffer*/
     for (int index = 0; index < map->size; index++) {
         /*Skip empties*/
-        if (map->values[index] == 0)
+        if (!generalmapOccupied(map, index))
             continue;
 
-        /*Call the dtor*/
+        void* value = generalmapValueAt(map, index);
+
+        /*Call the dtor, but not on null values*/
 
         if (keyDtor)
-            keyDtor(map->keysStrMutable[index], map->values[index]);
+            keyDtor((char*) generalmapKeyAt(map, index), value);
 
-        if (valueDtor)
-            valueDtor(map->values[index]);
+        if (valueDtor && value)
+            valueDtor(value);
     }
 
+    if (map->old)
+        generalmapFreeObjs(map->old, keyDtor, valueDtor, hashes);
+
     return generalmapFree(map, hashes);
 }
 
-static inline bool generalmapIsMatch (const generalmap* map, int index, const char* key, int hash, generalmapCmp cmp) {
-    if (cmp)
-        return    map->hashes[index] == hash
-               && !cmp(map->keysStr[index], key);
+static inline const char* generalmapKeyAt (const generalmap* map, int index) {
+    if (map->layout != maplayout_split)
+        return map->slots[index].keyStr;
+
+    else
+        return map->keysStr[index];
+}
+
+static inline uint64_t generalmapHashAt (const generalmap* map, int index) {
+    if (map->layout != maplayout_split)
+        return map->slots[index].hash;
+
+    else
+        return map->hashes[index];
+}
+
+static inline void* generalmapValueAt (const generalmap* map, int index) {
+    if (map->layout != maplayout_split)
+        return map->slots[index].value;
+
+    else
+        return map->values[index];
+}
+
+static inline void generalmapSetAt (generalmap* map, int index, const char* key, uint64_t hash, void* value) {
+    map->ctrl[index] = hash >> 57;
+
+    if (map->layout != maplayout_split)
+        map->slots[index] = (generalmapSlot) {.keyStr = key, .hash = hash, .value = value};
+
+    else {
+        map->keysStr[index] = key;
+        map->values[index] = value;
+
+        if (map->hashes)
+            map->hashes[index] = hash;
+    }
+}
+
+static inline void generalmapSetValueAt (generalmap* map, int index, void* value) {
+    if (map->layout != maplayout_split)
+        map->slots[index].value = value;
 
     else
-        return map->keysStr[index] == key;
+        map->values[index] = value;
+}
+
+static inline bool generalmapOccupied (const generalmap* map, int index) {
+    /*Empty and deleted have the top bit set, tags don't*/
+    return !(map->ctrl[index] & 0x80);
+}
+
+static inline void generalmapClearAt (generalmap* map, int index) {
+    generalmapSetAt(map, index, 0, 0, 0);
+    map->ctrl[index] = mapctrl_empty;
+}
+
+static inline uint64_t generalmapSlotHash (const generalmap* map, int index, generalmapHash hashf) {
+    /*Only split maps without a cmp don't store them*/
+    if (map->layout == maplayout_split && !map->hashes)
+        return hashf(generalmapKeyAt(map, index));
+
+    else
+        return generalmapHashAt(map, index);
+}
+
+static inline bool generalmapIsMatch (const generalmap* map, int index, const char* key, uint64_t hash, generalmapCmp cmp) {
+    /*Empty slots never match, and other keys almost never have the
+      same tag. This only needs the control byte.*/
+    if (map->ctrl[index] != hash >> 57)
+        return false;
+
+    /*The full hashes almost never collide, so this rules out nearly
+      every other key without touching its bytes*/
+    else if (cmp)
+        return    generalmapHashAt(map, index) == hash
+               && !cmp(generalmapKeyAt(map, index), key);
+
+    else
+        return generalmapKeyAt(map, index) == key;
 }
 
 static inline int generalmapFind (const generalmap* map, const char* key,
-                                  int hash, generalmapCmp cmp) {
-    /*Check from the first choice slot all the way until the end of
-      the values buffer, if need be*/
-    for (int index = hash; index < map->size; index++)
-        /*Exit if empty or found the key*/
-        if (map->values[index] == 0 || generalmapIsMatch(map, index, key, hash, cmp))
+                                  uint64_t hash, generalmapCmp cmp) {
+    if (map->layout == maplayout_grouped)
+        return generalmapFindGrouped(map, key, hash, cmp);
+
+    /*The size is a power of two, so masking wraps around the end*/
+    int mask = map->size-1;
+
+    /*Nothing is further than maxProbe from its first choice, so a miss
+      can stop there without needing to reach an empty slot*/
+    for (int distance = 0; distance <= map->maxProbe; distance++) {
+        int index = (hash + distance) & mask;
+
+        /*Deleted slots, only left in a table being migrated from, don't
+          end the probe, and never match*/
+        if (map->ctrl[index] == mapctrl_empty)
+            return -1;
+
+        else if (generalmapIsMatch(map, index, key, hash, cmp))
             return index;
+    }
+
+    return -1;
+}
 
-    /*Then from the start all the way back to the first choice slot*/
-    for (int index = 0; index < hash; index++)
-        if (map->values[index] == 0 || generalmapIsMatch(map, index, key, hash, cmp))
+static inline int generalmapFindEmpty (const generalmap* map, uint64_t hash, int* distance) {
+    if (map->layout == maplayout_grouped)
+        return generalmapFindEmptyGrouped(map, hash, distance);
+
+    int mask = map->size-1;
+
+    for (*distance = 0; ; (*distance)++) {
+        int index = (hash + *distance) & mask;
+
+        if (!generalmapOccupied(map, index))
             return index;
+    }
+}
 
-    /*Done an entire sweep of the buffer, not found & full*/
-    return hash;
+#ifndef __SSE2__
+
+static inline uint64_t generalmapGroupLoad (const uint8_t* ctrl) {
+    uint64_t word;
+    memcpy(&word, ctrl, sizeof(word));
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+
+    return word;
+}
+
+/*Gathers the top bit of each byte into a byte*/
+static inline unsigned generalmapSwarGather (uint64_t highbits) {
+    return ((highbits >> 7) * 0x0102040810204080ull) >> 56;
+}
+
+static inline unsigned generalmapSwarMatch (uint64_t word, uint8_t tag) {
+    const uint64_t lsbs = 0x0101010101010101ull;
+    /*Bytes equal to the tag become zero, then find the zero bytes.
+      A borrow can cause a false positive above a true one.*/
+    uint64_t x = word ^ (lsbs * tag);
+    return generalmapSwarGather((x - lsbs) & ~x & (lsbs << 7));
+}
+
+static inline unsigned generalmapSwarEmpty (uint64_t word) {
+    /*Only empty has the top bit set but not the second lowest*/
+    return generalmapSwarGather(word & (~word << 6) & 0x8080808080808080ull);
+}
+
+#endif
+
+static inline unsigned generalmapGroupMatch (const uint8_t* ctrl, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+    return   generalmapSwarMatch(generalmapGroupLoad(ctrl), tag)
+           | generalmapSwarMatch(generalmapGroupLoad(ctrl+8), tag) << 8;
+#endif
+}
+
+static inline unsigned generalmapGroupEmpty (const uint8_t* ctrl) {
+#ifdef __SSE2__
+    return generalmapGroupMatch(ctrl, mapctrl_empty);
+#else
+    return   generalmapSwarEmpty(generalmapGroupLoad(ctrl))
+           | generalmapSwarEmpty(generalmapGroupLoad(ctrl+8)) << 8;
+#endif
+}
+
+static inline unsigned generalmapGroupEmptyOrDeleted (const uint8_t* ctrl) {
+    /*Both, and only they, have the top bit set*/
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) ctrl));
+#else
+    const uint64_t msbs = 0x8080808080808080ull;
+    return   generalmapSwarGather(generalmapGroupLoad(ctrl) & msbs)
+           | generalmapSwarGather(generalmapGroupLoad(ctrl+8) & msbs) << 8;
+#endif
+}
+
+static inline int generalmapFindGrouped (const generalmap* map, const char* key,
+                                         uint64_t hash, generalmapCmp cmp) {
+    /*The low bits choose the group, and the top 7 are the tag*/
+    int groupmask = map->size/mapgroup_width - 1;
+    int group = (hash / mapgroup_width) & groupmask;
+    uint8_t tag = hash >> 57;
+
+    /*Triangular probing over the groups, which visits each of them
+      as the number of groups is a power of two*/
+    for (int distance = 0; distance <= map->maxProbe; distance++) {
+        group = (group + distance) & groupmask;
+        const uint8_t* ctrl = map->ctrl + group*mapgroup_width;
+
+        for (unsigned match = generalmapGroupMatch(ctrl, tag); match; match &= match-1) {
+            int index = group*mapgroup_width + __builtin_ctz(match);
+
+            if (generalmapIsMatch(map, index, key, hash, cmp))
+                return index;
+        }
+
+        /*Insertion would have stopped here*/
+        if (generalmapGroupEmpty(ctrl))
+            return -1;
+    }
+
+    return -1;
+}
+
+static inline int generalmapFindEmptyGrouped (const generalmap* map, uint64_t hash, int* distance) {
+    int groupmask = map->size/mapgroup_width - 1;
+    int group = (hash / mapgroup_width) & groupmask;
+
+    for (*distance = 0; ; (*distance)++) {
+        group = (group + *distance) & groupmask;
+        /*Tombstones can be reused*/
+        unsigned free = generalmapGroupEmptyOrDeleted(map->ctrl + group*mapgroup_width);
+
+        if (free)
+            return group*mapgroup_width + __builtin_ctz(free);
+    }
+}
+
+static inline void generalmapRemoveGrouped (generalmap* map, int index) {
+    const uint8_t* group = map->ctrl + (index & ~(mapgroup_width-1));
+
+    /*Probes only continue past full groups. If this group has an empty
+      slot then it has never been full, and no probe depends on this
+      slot. Otherwise, leave a tombstone so they carry on.*/
+    if (generalmapGroupEmpty(group))
+        map->ctrl[index] = mapctrl_empty;
+
+    else {
+        map->ctrl[index] = mapctrl_deleted;
+        map->tombstones++;
+    }
+
+    map->slots[index] = (generalmapSlot) {.value = 0};
+}
+
+static inline const generalmap* generalmapLocate (const generalmap* map, const char* key,
+                                                  uint64_t hash, generalmapCmp cmp, int* index) {
+    if ((*index = generalmapFind(map, key, hash, cmp)) >= 0)
+        return map;
+
+    else if (map->old && (*index = generalmapFind(map->old, key, hash, cmp)) >= 0)
+        return map->old;
+
+    else
+        return 0;
 }
 
 static inline bool generalmapAdd (generalmap* map, const char* key, void* value,
                                   generalmapHash hashf, generalmapCmp cmp, bool values) {
-    /*Half full: create a new one twice the size and copy elements over.
-      Allows us to assume there is space for the key.*/
-    if (map->elements*2 + 1 >= map->size) {
-        generalmap newmap = generalmapInit(map->size*2, calloc, cmp != 0);
-        generalmapMerge(&newmap, map, hashf, cmp, 0, values);
-        generalmapFree(map, cmp != 0);
-        *map = newmap;
+    return generalmapAddHashed(map, key, hashf(key), value, hashf, cmp, values);
+}
+
+static inline bool generalmapAddHashed (generalmap* map, const char* key, uint64_t hash, void* value,
+                                        generalmapHash hashf, generalmapCmp cmp, bool values) {
+    generalmapMigrate(map, mapmigrate_slots, hashf);
+
+    /*Full to the max load: create a new one twice the size and copy
+      elements over. Allows us to assume there is space for the key.
+      If it's mostly tombstones, just clear them out at the same size.*/
+    int capacity = generalmapCapacity(map, map->size);
+
+    if (map->elements + map->tombstones + 1 > capacity)
+        generalmapGrow(map, (map->elements+1)*2 > capacity ? map->size*2 : map->size, hashf);
+
+    int index;
+    /*Cast away the const, it's one of ours*/
+    generalmap* table = (generalmap*) generalmapLocate(map, key, hash, cmp, &index);
+
+    bool present = table != 0;
+    value = values ? value : (void*) true;
+
+    /*Present, remap (even if it's yet to be migrated)*/
+    if (present)
+        generalmapSetValueAt(table, index, value);
+
+    else
+        generalmapInsert(map, key, hash, value);
+
+    return present;
+}
+
+static inline int generalmapInsert (generalmap* map, const char* key, uint64_t hash, void* value) {
+    /*Take the first empty spot*/
+    int distance;
+    int index = generalmapFindEmpty(map, hash, &distance);
+
+    if (distance > map->maxProbe)
+        map->maxProbe = distance;
+
+    if (map->ctrl[index] == mapctrl_deleted)
+        map->tombstones--;
+
+    generalmapSetAt(map, index, key, hash, value);
+    map->elements++;
+    return index;
+}
+
+static inline int generalmapCapacity (const generalmap* map, int size) {
+    int capacity = (double) size * map->maxLoad;
+
+    /*Probing relies on there being an empty slot*/
+    return capacity < size ? capacity : size-1;
+}
+
+static inline int generalmapSizeFor (const generalmap* map, int elements) {
+    int size = map->layout == maplayout_grouped ? mapgroup_width : 1;
+
+    while (generalmapCapacity(map, size) < elements)
+        size *= 2;
+
+    return size;
+}
+
+static inline generalmap generalmapInitLike (const generalmap* map, int size) {
+    generalmap newmap = generalmapInit(size, map->alloc, map->hashes != 0, map->layout);
+    newmap.maxLoad = map->maxLoad;
+    newmap.incremental = map->incremental;
+    return newmap;
+}
+
+static inline void generalmapResize (generalmap* map, int size, generalmapHash hashf) {
+    generalmapMigrate(map, INT_MAX, hashf);
+
+    generalmap newmap = generalmapInitLike(map, size);
+
+    for (int index = 0; index < map->size; index++)
+        if (generalmapOccupied(map, index))
+            generalmapInsert(&newmap, generalmapKeyAt(map, index),
+                             generalmapSlotHash(map, index, hashf), generalmapValueAt(map, index));
+
+    generalmapFree(map, true);
+    *map = newmap;
+}
+
+static inline void generalmapGrow (generalmap* map, int size, generalmapHash hashf) {
+    if (!map->incremental) {
+        generalmapResize(map, size, hashf);
+        return;
     }
 
-    int hash = hashf(key, map->size);
-    int index = generalmapFind(map, key, hash, cmp);
+    /*Can only migrate from one table at a time*/
+    generalmapMigrate(map, INT_MAX, hashf);
 
-    bool present;
+    generalmap* old = allocatorMalloc(&map->alloc, sizeof(generalmap));
+    *old = *map;
 
-    /*Empty spot*/
-    if (map->values[index] == 0) {
-        map->keysStr[index] = key;
-        map->elements++;
-        present = false;
+    *map = generalmapInitLike(old, size);
+    map->elements = old->elements;
+    map->old = old;
 
-        if (cmp != 0)
-            map->hashes[index] = hash;
+    map->migrateAt = 0;
+}
 
-    /*Present, remap*/
-    } else {
-        assert(generalmapIsMatch(map, index, key, hash, cmp));
-        present = true;
+/*Empties a slot of a table being migrated from. As with the grouped
+  layout, it leaves a tombstone, so that probes through it carry on to
+  the rest of the cluster. Nothing is ever inserted there again.*/
+static inline void generalmapVacate (generalmap* old, int index) {
+    if (old->layout == maplayout_grouped)
+        generalmapRemoveGrouped(old, index);
+
+    else {
+        generalmapSetAt(old, index, 0, 0, 0);
+        old->ctrl[index] = mapctrl_deleted;
     }
 
-    map->values[index] = values ? value : (void*) true;
+    old->elements--;
+}
 
-    return present;
+static inline void generalmapMigrate (generalmap* map, int slots, generalmapHash hashf) {
+    generalmap* old = map->old;
+
+    if (!old)
+        return;
+
+    int mask = old->size-1;
+
+    /*Migrated slots are left as tombstones, so this can stop anywhere,
+      even partway through a cluster*/
+    for (int n = 0; old->elements != 0 && n < slots; n++) {
+        int index = map->migrateAt;
+        map->migrateAt = (index+1) & mask;
+
+        if (!generalmapOccupied(old, index))
+            continue;
+
+        generalmapInsert(map, generalmapKeyAt(old, index), generalmapSlotHash(old, index, hashf),
+                         generalmapValueAt(old, index));
+        /*Already counted*/
+        map->elements--;
+        generalmapVacate(old, index);
+    }
+
+    if (old->elements == 0) {
+        generalmapFree(old, true);
+        allocatorFree(&map->alloc, old, sizeof(generalmap));
+        map->old = 0;
+    }
 }
 
 static inline void generalmapMerge (generalmap* dest, const generalmap* src,
-                                    generalmapHash hash, generalmapCmp cmp, generalmapDup dup, bool values) {
+                                    generalmapHash hash, generalmapCmp cmp, bool dup, bool values) {
     for (int index = 0; index < src->size; index++) {
-        if (src->keysInt[index] == 0)
+        if (!generalmapOccupied(src, index))
             continue;
 
-        char* key = src->keysStrMutable[index];
+        char* key = (char*) generalmapKeyAt(src, index);
 
         if (dup)
-            key = dup(key);
+            key = allocatorStrdup(&dest->alloc, key);
 
-        generalmapAdd(dest, key, values ? src->values[index] : 0, hash, cmp, values);
+        generalmapAdd(dest, key, values ? generalmapValueAt(src, index) : 0, hash, cmp, values);
     }
+
+    /*And what's yet to be migrated*/
+    if (src->old)
+        generalmapMerge(dest, src->old, hash, cmp, dup, values);
 }
 
 static inline void* generalmapMap (const generalmap* map, const char* key, generalmapHash hashf, generalmapCmp cmp) {
-    int hash = hashf(key, map->size);
-    int index = generalmapFind(map, key, hash, cmp);
-    return generalmapIsMatch(map, index, key, hash, cmp) ? map->values[index] : 0;
+    int index;
+    const generalmap* table = generalmapLocate(map, key, hashf(key), cmp, &index);
+    return table ? generalmapValueAt(table, index) : 0;
 }
 
 static inline bool generalmapTest (const generalmap* map, const char* key, generalmapHash hashf, generalmapCmp cmp) {
-    int hash = hashf(key, map->size);
-    int index = generalmapFind(map, key, hash, cmp);
-    return generalmapIsMatch(map, index, key, hash, cmp);
+    int index;
+    return generalmapLocate(map, key, hashf(key), cmp, &index) != 0;
+}
+
+static inline bool generalmapTryGet (const generalmap* map, const char* key, void** value,
+                                     generalmapHash hashf, generalmapCmp cmp) {
+    return generalmapTryGetHashed(map, key, hashf(key), value, cmp);
+}
+
+static inline bool generalmapTryGetHashed (const generalmap* map, const char* key, uint64_t hash,
+                                           void** value, generalmapCmp cmp) {
+    int index;
+    const generalmap* table = generalmapLocate(map, key, hash, cmp, &index);
+
+    if (table)
+        *value = generalmapValueAt(table, index);
+
+    return table != 0;
+}
+
+enum {
+    /*Enough keys that the first one's slot has arrived by the time the
+      last one's has been requested*/
+    mapbatch_block = 16
+};
+
+/*Prefetch the first choice slot for a hash, and its value if wanted*/
+static inline void generalmapPrefetch (const generalmap* map, uint64_t hash, bool value) {
+    int index = hash & (map->size-1);
+
+    /*Which slot of the group isn't known until the control bytes are*/
+    if (map->layout == maplayout_grouped) {
+        __builtin_prefetch(map->ctrl + (index & ~(mapgroup_width-1)));
+        return;
+    }
+
+    __builtin_prefetch(map->ctrl + index);
+
+    if (map->layout == maplayout_packed)
+        __builtin_prefetch(map->slots + index);
+
+    else {
+        if (map->hashes)
+            __builtin_prefetch(map->hashes + index);
+
+        else
+            __builtin_prefetch(map->keysInt + index);
+
+        /*Sets have none*/
+        if (value && map->values)
+            __builtin_prefetch(map->values + index);
+    }
+}
+
+static inline void generalmapBatch (const generalmap* map, const char* const* keys, int n,
+                                    void** values, bool* results, generalmapHash hashf, generalmapCmp cmp) {
+    uint64_t hashes[mapbatch_block];
+
+    for (int start = 0; start < n; start += mapbatch_block) {
+        int length = n-start < mapbatch_block ? n-start : mapbatch_block;
+
+        /*Hash the whole block, requesting each slot as we go. Its key
+          (for strings) is only fetched once the hash matches.*/
+        for (int i = 0; i < length; i++) {
+            hashes[i] = hashf(keys[start+i]);
+            generalmapPrefetch(map, hashes[i], values != 0);
+        }
+
+        /*Then resolve them, by now mostly from cache*/
+        for (int i = 0; i < length; i++) {
+            int index;
+            const generalmap* table = generalmapLocate(map, keys[start+i], hashes[i], cmp, &index);
+
+            if (values)
+                values[start+i] = table ? generalmapValueAt(table, index) : 0;
+
+            if (results)
+                results[start+i] = table != 0;
+        }
+    }
+}
+
+static inline bool generalmapRemove (generalmap* map, const char* key, generalmapHash hashf, generalmapCmp cmp) {
+    return generalmapRemoveHashed(map, key, hashf(key), hashf, cmp);
+}
+
+static inline bool generalmapRemoveHashed (generalmap* map, const char* key, uint64_t hash,
+                                           generalmapHash hashf, generalmapCmp cmp) {
+    generalmapMigrate(map, mapmigrate_slots, hashf);
+
+    int index;
+    generalmap* table = (generalmap*) generalmapLocate(map, key, hash, cmp, &index);
+
+    if (!table)
+        return false;
+
+    /*Backward shifting in the old table would pull elements back across
+      the tombstones, out of the migration's way*/
+    if (table == map->old) {
+        generalmapVacate(table, index);
+        map->elements--;
+
+    } else
+        generalmapRemoveAt(table, index, hashf);
+
+    return true;
+}
+
+static inline void generalmapRemoveAt (generalmap* map, int index, generalmapHash hashf) {
+    map->elements--;
+
+    if (map->layout == maplayout_grouped) {
+        generalmapRemoveGrouped(map, index);
+        return;
+    }
+
+    /*Backward shift deletion: rather than leaving a tombstone, pull each
+      following element of the cluster back into the hole, as long as that
+      doesn't move it before its first choice slot. Probe lengths are then
+      exactly as if the key had never been added.*/
+
+    int mask = map->size-1;
+    int hole = index;
+
+    for (int next = (hole+1) & mask; generalmapOccupied(map, next); next = (next+1) & mask) {
+        uint64_t nextHash = generalmapSlotHash(map, next, hashf);
+        int home = nextHash & mask;
+
+        /*Only if the hole is no further back than its first choice*/
+        if (((next - home) & mask) < ((next - hole) & mask))
+            continue;
+
+        generalmapSetAt(map, hole, generalmapKeyAt(map, next), nextHash, generalmapValueAt(map, next));
+        hole = next;
+    }
+
+    generalmapClearAt(map, hole);
+}
+
+/*==== Resizing ====*/
+
+/*Only maps without a cmp (int keys) don't store their hashes, and only
+  they need a hash function to resize*/
+
+static inline void mapReserve (generalmap* map, int elements) {
+    if (generalmapCapacity(map, map->size) - map->tombstones < elements)
+        generalmapResize(map, generalmapSizeFor(map, elements), generalmapHashInt);
+}
+
+static inline void mapShrinkToFit (generalmap* map) {
+    int size = generalmapSizeFor(map, map->elements);
+
+    if (size < map->size || map->tombstones != 0)
+        generalmapResize(map, size, generalmapHashInt);
+}
+
+static inline void mapSetMaxLoad (generalmap* map, float maxLoad) {
+    assert(maxLoad > 0 && maxLoad < 1);
+    map->maxLoad = maxLoad;
+}
+
+static inline generalmap mapDup (const generalmap* map) {
+    generalmap dup = generalmapInitLike(map, map->size);
+
+    if (map->layout != maplayout_split)
+        memcpy(dup.slots, map->slots, map->size*sizeof(generalmapSlot));
+
+    else {
+        memcpy(dup.keysInt, map->keysInt, map->size*sizeof(intptr_t));
+        memcpy(dup.values, map->values, map->size*sizeof(void*));
+
+        if (map->hashes)
+            memcpy(dup.hashes, map->hashes, map->size*sizeof(uint64_t));
+    }
+
+    memcpy(dup.ctrl, map->ctrl, map->size);
+
+    dup.elements = map->elements;
+    dup.maxProbe = map->maxProbe;
+    dup.tombstones = map->tombstones;
+
+    if (map->old) {
+        dup.old = allocatorMalloc(&map->alloc, sizeof(generalmap));
+        *dup.old = mapDup(map->old);
+        dup.migrateAt = map->migrateAt;
+    }
+
+    return dup;
 }
 
 /*==== HASHMAP ====*/
 
 static inline hashmap hashmapInit (int size, calloc_t calloc) {
-    return generalmapInit(size, calloc, true);
+    return generalmapInit(size, allocatorFromCalloc(calloc), true, maplayout_split);
+}
+
+static inline hashmap hashmapInitLayout (int size, calloc_t calloc, maplayout layout) {
+    return generalmapInit(size, allocatorFromCalloc(calloc), true, layout);
+}
+
+static inline hashmap hashmapInitAlloc (int size, allocator alloc, maplayout layout) {
+    return generalmapInit(size, alloc, true, layout);
 }
 
 static inline hashmap* hashmapFree (hashmap* map) {
@@ -377,17 +1332,37 @@ static inline void hashmapMerge (hashmap* dest, hashmap* src) {
 }
 
 static inline void hashmapMergeDup (hashmap* dest, const hashmap* src) {
-    generalmapMerge(dest, src, hashstr, strcmp, strdup, true);
+    generalmapMerge(dest, src, hashstr, strcmp, true, true);
 }
 
 static inline void* hashmapMap (const hashmap* map, const char* key) {
     return generalmapMap(map, key, hashstr, strcmp);
 }
 
+static inline bool hashmapTryGet (const hashmap* map, const char* key, void** value) {
+    return generalmapTryGet(map, key, value, hashstr, strcmp);
+}
+
+static inline void hashmapMapBatch (const hashmap* map, const char** keys, int n, void** values) {
+    generalmapBatch(map, keys, n, values, 0, hashstr, strcmp);
+}
+
+static inline bool hashmapRemove (hashmap* map, const char* key) {
+    return generalmapRemove(map, key, hashstr, strcmp);
+}
+
 /*==== intmap ====*/
 
 static inline intmap intmapInit (int size, calloc_t calloc) {
-    return generalmapInit(size, calloc, false);
+    return generalmapInit(size, allocatorFromCalloc(calloc), false, maplayout_split);
+}
+
+static inline intmap intmapInitLayout (int size, calloc_t calloc, maplayout layout) {
+    return generalmapInit(size, allocatorFromCalloc(calloc), false, layout);
+}
+
+static inline intmap intmapInitAlloc (int size, allocator alloc, maplayout layout) {
+    return generalmapInit(size, alloc, false, layout);
 }
 
 static inline intmap* intmapFree (intmap* map) {
@@ -399,21 +1374,57 @@ static inline intmap* intmapFreeObjs (intmap* map, intmapValueDtor dtor) {
 }
 
 static inline bool intmapAdd (intmap* map, intptr_t element, void* value) {
-    return generalmapAdd(map, (void*) element, value, (generalmapHash) hashint, 0, true);
+    return generalmapAdd(map, (void*) element, value, generalmapHashInt, 0, true);
 }
 
 static inline void intmapMerge (intmap* dest, const intmap* src) {
-    generalmapMerge(dest, src, (generalmapHash) hashint, 0, 0, true);
+    generalmapMerge(dest, src, generalmapHashInt, 0, 0, true);
 }
 
 static inline void* intmapMap (const intmap* map, intptr_t element) {
-    return generalmapMap(map, (void*) element, (generalmapHash) hashint, 0);
+    return generalmapMap(map, (void*) element, generalmapHashInt, 0);
+}
+
+/*Convert each block of int keys into the pointers generalmap takes*/
+static inline void generalmapBatchInt (const generalmap* map, const intptr_t* elements, int n,
+                                       void** values, bool* results) {
+    const char* keys[mapbatch_block];
+
+    for (int start = 0; start < n; start += mapbatch_block) {
+        int length = n-start < mapbatch_block ? n-start : mapbatch_block;
+
+        for (int i = 0; i < length; i++)
+            keys[i] = (const char*) elements[start+i];
+
+        generalmapBatch(map, keys, length, values ? values+start : 0, results ? results+start : 0,
+                        generalmapHashInt, 0);
+    }
+}
+
+static inline bool intmapTryGet (const intmap* map, intptr_t element, void** value) {
+    return generalmapTryGet(map, (void*) element, value, generalmapHashInt, 0);
+}
+
+static inline void intmapMapBatch (const intmap* map, const intptr_t* elements, int n, void** values) {
+    generalmapBatchInt(map, elements, n, values, 0);
+}
+
+static inline bool intmapRemove (intmap* map, intptr_t element) {
+    return generalmapRemove(map, (void*) element, generalmapHashInt, 0);
 }
 
 /*==== hashset ====*/
 
 static inline hashset hashsetInit (int size, calloc_t calloc) {
-    return generalmapInit(size, calloc, true);
+    return generalmapInit(size, allocatorFromCalloc(calloc), true, maplayout_split);
+}
+
+static inline hashset hashsetInitLayout (int size, calloc_t calloc, maplayout layout) {
+    return generalmapInit(size, allocatorFromCalloc(calloc), true, layout);
+}
+
+static inline hashset hashsetInitAlloc (int size, allocator alloc, maplayout layout) {
+    return generalmapInit(size, alloc, true, layout);
 }
 
 static inline hashset* hashsetFree (hashset* set) {
@@ -433,17 +1444,33 @@ static inline void hashsetMerge (hashset* dest, hashset* src) {
 }
 
 static inline void hashsetMergeDup (hashset* dest, const hashset* src) {
-    generalmapMerge(dest, src, hashstr, strcmp, strdup, false);
+    generalmapMerge(dest, src, hashstr, strcmp, true, false);
 }
 
 static inline bool hashsetTest (const hashset* set, const char* element) {
     return generalmapTest(set, element, hashstr, strcmp);
 }
 
+static inline void hashsetTestBatch (const hashset* set, const char** elements, int n, bool* results) {
+    generalmapBatch(set, elements, n, 0, results, hashstr, strcmp);
+}
+
+static inline bool hashsetRemove (hashset* set, const char* element) {
+    return generalmapRemove(set, element, hashstr, strcmp);
+}
+
 /*==== intset ====*/
 
 static inline intset intsetInit (int size, calloc_t calloc) {
-    return generalmapInit(size, calloc, false);
+    return generalmapInit(size, allocatorFromCalloc(calloc), false, maplayout_split);
+}
+
+static inline intset intsetInitLayout (int size, calloc_t calloc, maplayout layout) {
+    return generalmapInit(size, allocatorFromCalloc(calloc), false, layout);
+}
+
+static inline intset intsetInitAlloc (int size, allocator alloc, maplayout layout) {
+    return generalmapInit(size, alloc, false, layout);
 }
 
 static inline intset* intsetFree (intset* set) {
@@ -451,13 +1478,191 @@ static inline intset* intsetFree (intset* set) {
 }
 
 static inline bool intsetAdd (intset* set, intptr_t element) {
-    return generalmapAdd(set, (void*) element, 0, (generalmapHash) hashint, 0, false);
+    return generalmapAdd(set, (void*) element, 0, generalmapHashInt, 0, false);
 }
 
 static inline void intsetMerge (intset* dest, const intset* src) {
-    generalmapMerge(dest, src, (generalmapHash) hashint, 0, 0, false);
+    generalmapMerge(dest, src, generalmapHashInt, 0, 0, false);
 }
 
 static inline bool intsetTest (const intset* set, intptr_t element) {
-    return generalmapTest(set, (void*) element, (generalmapHash) hashint, 0);
+    return generalmapTest(set, (void*) element, generalmapHashInt, 0);
+}
+
+static inline void intsetTestBatch (const intset* set, const intptr_t* elements, int n, bool* results) {
+    generalmapBatchInt(set, elements, n, 0, results);
+}
+
+static inline bool intsetRemove (intset* set, intptr_t element) {
+    return generalmapRemove(set, (void*) element, generalmapHashInt, 0);
 }
+
+/*==== Typed maps ====*/
+
+#define DEFINE_MAP__(name, K, V, hash, eq)                                               \
+    typedef struct name##Slot {                                                         \
+        K key;                                                                          \
+        V value;                                                                        \
+    } name##Slot;                                                                       \
+                                                                                        \
+    typedef struct name {                                                               \
+        int size, elements, tombstones;                                                 \
+        uint8_t* ctrl;                                                                  \
+        name##Slot* slots;                                                              \
+        allocator alloc;                                                                \
+    } name;                                                                             \
+                                                                                        \
+    static inline name name##InitAlloc (int size, allocator alloc) {                    \
+        /*A power of two groups*/                                                       \
+        size = pow2ize(size);                                                           \
+        size = size < mapgroup_width ? mapgroup_width : size;                           \
+                                                                                        \
+        name map = {.size = size, .alloc = alloc};                                      \
+        map.slots = allocatorMalloc(&map.alloc, size*sizeof(name##Slot));               \
+        map.ctrl = allocatorMalloc(&map.alloc, size);                                   \
+        memset(map.ctrl, mapctrl_empty, size);                                          \
+        return map;                                                                     \
+    }                                                                                   \
+                                                                                        \
+    static inline name name##Init (int size) {                                          \
+        return name##InitAlloc(size, stdallocator);                                     \
+    }                                                                                   \
+                                                                                        \
+    static inline name* name##Free (name* map) {                                        \
+        allocatorFree(&map->alloc, map->slots, map->size*sizeof(name##Slot));           \
+        allocatorFree(&map->alloc, map->ctrl, map->size);                               \
+        map->slots = 0;                                                                 \
+        map->ctrl = 0;                                                                  \
+        map->elements = map->tombstones = 0;                                            \
+        return map;                                                                     \
+    }                                                                                   \
+                                                                                        \
+    /*As generalmapFindGrouped*/                                                        \
+    static inline int name##Find (const name* map, K key, uint64_t hashed) {            \
+        int groupmask = map->size/mapgroup_width - 1;                                   \
+        int group = (hashed / mapgroup_width) & groupmask;                              \
+        uint8_t tag = hashed >> 57;                                                     \
+                                                                                        \
+        for (int distance = 0; distance <= groupmask; distance++) {                     \
+            group = (group + distance) & groupmask;                                     \
+            const uint8_t* ctrl = map->ctrl + group*mapgroup_width;                     \
+                                                                                        \
+            for (unsigned match = generalmapGroupMatch(ctrl, tag);                      \
+                 match; match &= match-1) {                                             \
+                int index = group*mapgroup_width + __builtin_ctz(match);                \
+                                                                                        \
+                if (eq(map->slots[index].key, key))                                     \
+                    return index;                                                       \
+            }                                                                           \
+                                                                                        \
+            if (generalmapGroupEmpty(ctrl))                                             \
+                return -1;                                                              \
+        }                                                                               \
+                                                                                        \
+        return -1;                                                                      \
+    }                                                                                   \
+                                                                                        \
+    /*Places a key known not to be present*/                                            \
+    static inline void name##Insert (name* map, K key, uint64_t hashed, V value) {      \
+        int groupmask = map->size/mapgroup_width - 1;                                   \
+        int group = (hashed / mapgroup_width) & groupmask;                              \
+        unsigned free;                                                                  \
+                                                                                        \
+        for (int distance = 0; ; distance++) {                                          \
+            group = (group + distance) & groupmask;                                     \
+            free = generalmapGroupEmptyOrDeleted(map->ctrl + group*mapgroup_width);     \
+                                                                                        \
+            if (free)                                                                   \
+                break;                                                                  \
+        }                                                                               \
+                                                                                        \
+        int index = group*mapgroup_width + __builtin_ctz(free);                         \
+                                                                                        \
+        if (map->ctrl[index] == mapctrl_deleted)                                        \
+            map->tombstones--;                                                          \
+                                                                                        \
+        map->ctrl[index] = hashed >> 57;                                                \
+        map->slots[index] = (name##Slot) {key, value};                                  \
+        map->elements++;                                                                \
+    }                                                                                   \
+                                                                                        \
+    static inline void name##Resize (name* map, int size) {                             \
+        name newmap = name##InitAlloc(size, map->alloc);                                \
+                                                                                        \
+        for (int index = 0; index < map->size; index++)                                 \
+            if (!(map->ctrl[index] & 0x80))                                             \
+                name##Insert(&newmap, map->slots[index].key,                            \
+                             hash(map->slots[index].key), map->slots[index].value);     \
+                                                                                        \
+        name##Free(map);                                                                \
+        *map = newmap;                                                                  \
+    }                                                                                   \
+                                                                                        \
+    static inline bool name##Add (name* map, K key, V value) {                          \
+        uint64_t hashed = hash(key);                                                    \
+        int index = name##Find(map, key, hashed);                                       \
+                                                                                        \
+        if (index >= 0) {                                                               \
+            map->slots[index].value = value;                                            \
+            return true;                                                                \
+        }                                                                               \
+                                                                                        \
+        /*At 7/8 full, grow, or if it's mostly tombstones clear them out*/              \
+        int capacity = map->size/8*7;                                                   \
+                                                                                        \
+        if (map->elements + map->tombstones + 1 > capacity)                             \
+            name##Resize(map, (map->elements+1)*2 > capacity ? map->size*2 : map->size);\
+                                                                                        \
+        name##Insert(map, key, hashed, value);                                          \
+        return false;                                                                   \
+    }                                                                                   \
+                                                                                        \
+    static inline V* name##Get (const name* map, K key) {                               \
+        int index = name##Find(map, key, hash(key));                                    \
+        return index >= 0 ? &map->slots[index].value : 0;                               \
+    }                                                                                   \
+                                                                                        \
+    static inline V name##Map (const name* map, K key) {                                \
+        V* value = name##Get(map, key);                                                 \
+        return value ? *value : (V) {0};                                                \
+    }                                                                                   \
+                                                                                        \
+    static inline bool name##TryGet (const name* map, K key, V* value) {                \
+        V* found = name##Get(map, key);                                                 \
+                                                                                        \
+        if (found)                                                                      \
+            *value = *found;                                                            \
+                                                                                        \
+        return found != 0;                                                              \
+    }                                                                                   \
+                                                                                        \
+    static inline bool name##Test (const name* map, K key) {                            \
+        return name##Get(map, key) != 0;                                                \
+    }                                                                                   \
+                                                                                        \
+    static inline bool name##Remove (name* map, K key) {                                \
+        int index = name##Find(map, key, hash(key));                                    \
+                                                                                        \
+        if (index < 0)                                                                  \
+            return false;                                                               \
+                                                                                        \
+        /*As generalmapRemoveGrouped*/                                                  \
+        if (generalmapGroupEmpty(map->ctrl + (index & ~(mapgroup_width-1))))            \
+            map->ctrl[index] = mapctrl_empty;                                           \
+                                                                                        \
+        else {                                                                          \
+            map->ctrl[index] = mapctrl_deleted;                                         \
+            map->tombstones++;                                                          \
+        }                                                                               \
+                                                                                        \
+        map->elements--;                                                                \
+        return true;                                                                    \
+    }                                                                                   \
+                                                                                        \
+    static inline name##Slot* name##Next (const name* map, name##Slot* slot) {          \
+        for (int index = slot ? slot - map->slots + 1 : 0; index < map->size; index++)  \
+            if (!(map->ctrl[index] & 0x80))                                             \
+                return &map->slots[index];                                              \
+                                                                                        \
+        return 0;                                                                       \
+    }
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "common.h"
+#include "hashmap.h"
+#include "vector.h"
+
+#include <assert.h>
+
+/**
+ * A string interner: gives each distinct string one stable copy, and a
+ * small integer id, so that they can be compared by pointer or id.
+ *
+ * The copies are packed into large chunks (a bump arena) rather than
+ * each being malloc'd, and are only freed all at once, with the
+ * interner, in one free per chunk.
+ *
+ * Each copy is preceded by its length and id, so these are available
+ * from the pointer alone. They are indexed by a hashset which keeps
+ * their hashes, so interning a string that already is takes one hash
+ * and (almost always) one comparison, and the set grows without
+ * rehashing any of them.
+ *
+ * Strings with embedded null bytes can be interned with a length. The
+ * copies are null terminated either way.
+ */
+
+typedef struct internerHeader {
+    uint32_t length;
+    int32_t id;
+} internerHeader;
+
+typedef struct interner {
+    hashset set;
+    /*The strings by id*/
+    vector(const char*) strings;
+
+    /*Chunks of the arena, and the free space left in the current one*/
+    vector(char*) chunks;
+    char *at, *end;
+} interner;
+
+enum {
+    /*Strings longer than a quarter of this get a chunk of their own*/
+    interner_chunkSize = 64*1024
+};
+
+static interner internerInit (int size);
+static interner* internerFree (interner* in);
+
+/*Returns the interned copy of a string, adding it if need be*/
+static const char* internerAdd (interner* in, const char* str);
+static const char* internerAddN (interner* in, const char* str, size_t length);
+
+/*Returns the interned copy, or null if it hasn't been*/
+static const char* internerFind (const interner* in, const char* str);
+static const char* internerFindN (const interner* in, const char* str, size_t length);
+
+/*The id and length of an interned string, from the copy*/
+static int internerId (const char* interned);
+static size_t internerLength (const char* interned);
+
+/*The interned string with an id*/
+static const char* internerString (const interner* in, int id);
+
+/*How many distinct strings are interned*/
+static int internerCount (const interner* in);
+
+/*==== Inline implementations ====*/
+
+static inline interner internerInit (int size) {
+    return (interner) {
+        .set = hashsetInit(size, calloc),
+        .strings = vectorInit(size, malloc),
+        .chunks = vectorInit(16, malloc)
+    };
+}
+
+static inline interner* internerFree (interner* in) {
+    /*Just the chunks, not every string*/
+    vectorFreeObjs(&in->chunks, free);
+    vectorFree(&in->strings);
+    hashsetFree(&in->set);
+
+    in->at = in->end = 0;
+    return in;
+}
+
+static inline const internerHeader* internerHeaderOf (const char* interned) {
+    return (const internerHeader*) interned - 1;
+}
+
+static inline int internerId (const char* interned) {
+    return internerHeaderOf(interned)->id;
+}
+
+static inline size_t internerLength (const char* interned) {
+    return internerHeaderOf(interned)->length;
+}
+
+static inline const char* internerString (const interner* in, int id) {
+    return vectorGet(in->strings, id);
+}
+
+static inline int internerCount (const interner* in) {
+    return in->strings.length;
+}
+
+/*The set compares a string being looked up, given as one of these,
+  to an interned copy*/
+typedef struct internerQuery {
+    const char* str;
+    size_t length;
+} internerQuery;
+
+static inline int internerCmpQuery (const char* interned, const char* key) {
+    const internerQuery* query = (const internerQuery*) key;
+
+    if (internerLength(interned) != query->length)
+        return 1;
+
+    return memcmp(interned, query->str, query->length);
+}
+
+/*And two interned copies*/
+static inline int internerCmp (const char* interned, const char* key) {
+    internerQuery query = {key, internerLength(key)};
+    return internerCmpQuery(interned, (const char*) &query);
+}
+
+static inline const char* internerFindHashed (const interner* in, const char* str, size_t length, uint64_t hash) {
+    internerQuery query = {str, length};
+    int index;
+
+    /*Locate rather than TryGet, for the key rather than the value*/
+    const generalmap* table = generalmapLocate(&in->set, (const char*) &query, hash, internerCmpQuery, &index);
+
+    return table ? generalmapKeyAt(table, index) : 0;
+}
+
+static inline const char* internerFindN (const interner* in, const char* str, size_t length) {
+    return internerFindHashed(in, str, length, hashstrn(str, length));
+}
+
+static inline const char* internerFind (const interner* in, const char* str) {
+    return internerFindN(in, str, strlen(str));
+}
+
+/*Bump allocates room for a string and its header*/
+static inline internerHeader* internerAlloc (interner* in, size_t length) {
+    /*Keep the headers aligned*/
+    size_t size = sizeof(internerHeader) + length+1;
+    size = (size + _Alignof(internerHeader)-1) & ~(_Alignof(internerHeader)-1);
+
+    if ((size_t)(in->end - in->at) < size) {
+        /*Don't waste the rest of the current chunk on one big string*/
+        if (size > interner_chunkSize/4) {
+            char* chunk = malloc(size);
+            vectorPush(&in->chunks, chunk);
+            return (internerHeader*) chunk;
+        }
+
+        in->at = malloc(interner_chunkSize);
+        in->end = in->at + interner_chunkSize;
+        vectorPush(&in->chunks, in->at);
+    }
+
+    internerHeader* header = (internerHeader*) in->at;
+    in->at += size;
+    return header;
+}
+
+static inline const char* internerAddN (interner* in, const char* str, size_t length) {
+    assert(length <= UINT32_MAX);
+
+    uint64_t hash = hashstrn(str, length);
+    const char* interned = internerFindHashed(in, str, length, hash);
+
+    if (interned)
+        return interned;
+
+    internerHeader* header = internerAlloc(in, length);
+    *header = (internerHeader) {.length = length, .id = in->strings.length};
+
+    char* copy = (char*) (header+1);
+    memcpy(copy, str, length);
+    copy[length] = 0;
+
+    vectorPush(&in->strings, copy);
+
+    /*The set keeps the hashes, so hashstr is never actually called*/
+    generalmapAddHashed(&in->set, copy, hash, 0, hashstr, internerCmp, false);
+
+    return copy;
+}
+
+static inline const char* internerAdd (interner* in, const char* str) {
+    return internerAddN(in, str, strlen(str));
+}
@@ -1,31 +1,42 @@
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 #include "nicestat.h"
+#include "threadrun.h"
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <threads.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 
-static staterr nicestat_translate (bool error, struct stat st, stat_t* result) {
-    /*Translate the error, if any*/
-    if (error) {
-        switch (errno) {
-        case ENOMEM: return staterr_nomemory;
+staterr nicestat_error (int error) {
+    switch (error) {
+    case ENOMEM: return staterr_nomemory;
 
-        case ENOENT: return staterr_notexist;
-        case EACCES: return staterr_access;
-        case EOVERFLOW: return staterr_overflow;
+    case ENOENT: return staterr_notexist;
+    case EACCES: return staterr_access;
+    case EOVERFLOW: return staterr_overflow;
 
-        case ENOTDIR: return staterr_notdir;
-        case ENAMETOOLONG: return staterr_nametoolong;
-        case ELOOP: return staterr_loop;
+    case ENOTDIR: return staterr_notdir;
+    case ENAMETOOLONG: return staterr_nametoolong;
+    case ELOOP: return staterr_loop;
 
-        case EFAULT: return staterr_nullresultptr;
-        case EBADF: return staterr_baddescriptor;
-        case EINVAL: return staterr_badflags;
+    case EFAULT: return staterr_nullresultptr;
+    case EBADF: return staterr_baddescriptor;
+    case EINVAL: return staterr_badflags;
 
-        default: return staterr_other;
-        }
+    default: return staterr_other;
     }
+}
+
+static staterr nicestat_translate (bool error, struct stat st, stat_t* result) {
+    /*Translate the error, if any*/
+    if (error)
+        return nicestat_error(errno);
 
     /*Translate the mode*/
 
@@ -72,6 +83,300 @@ staterr nicefstat (int filedescriptor, stat_t* result) {
     return nicestat_translate(error, st, result);
 }
 
+/*==== Batches ====*/
+
+typedef struct statbatch {
+    staterr (*stat)(const char* filename, stat_t* result);
+    const char* const* filenames;
+    stat_t* results;
+    staterr* errors;
+    int n;
+    /*The next file to be taken by a thread*/
+    _Atomic int next;
+} statbatch;
+
+static int nicestat_batchworker (void* ctx) {
+    statbatch* batch = ctx;
+
+    for (int i; (i = atomic_fetch_add(&batch->next, 1)) < batch->n;)
+        batch->errors[i] = batch->stat(batch->filenames[i], &batch->results[i]);
+
+    return 0;
+}
+
+static int nicestat_runbatch (statbatch* batch, int threads) {
+    /*No more threads than files*/
+    threadrun(threads < batch->n ? threads : batch->n, nicestat_batchworker, batch);
+
+    int failed = 0;
+
+    for (int i = 0; i < batch->n; i++)
+        failed += batch->errors[i] != stat_success;
+
+    return failed;
+}
+
+int nicestat_batch (const char* const* filenames, int n, stat_t* results, staterr* errors, int threads) {
+    statbatch batch = {.stat = nicestat, .filenames = filenames, .results = results, .errors = errors, .n = n};
+    return nicestat_runbatch(&batch, threads);
+}
+
+int nicelstat_batch (const char* const* filenames, int n, stat_t* results, staterr* errors, int threads) {
+    statbatch batch = {.stat = nicelstat, .filenames = filenames, .results = results, .errors = errors, .n = n};
+    return nicestat_runbatch(&batch, threads);
+}
+
+/*==== Walks ====*/
+
+/*A growable array of entries, or of directories to read*/
+typedef struct statlist {
+    void* items;
+    int length, capacity;
+} statlist;
+
+static bool statlist_push (statlist* list, const void* item, size_t size) {
+    if (list->length == list->capacity) {
+        int capacity = list->capacity ? list->capacity*2 : 64;
+        void* items = realloc(list->items, capacity*size);
+
+        if (!items)
+            return false;
+
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    memcpy((char*) list->items + list->length*size, item, size);
+    list->length++;
+    return true;
+}
+
+/*A directory kept open until its subdirectories are opened from it*/
+typedef struct statdir {
+    DIR* dir;
+    /*Its subdirectories yet to be opened, and one while it's being read*/
+    int refs;
+} statdir;
+
+/*A directory waiting to be read, by its name in its parent (or, for the
+  root, its path), and the path of its entry*/
+typedef struct statqueued {
+    statdir* parent;
+    const char* name;
+    char* path;
+} statqueued;
+
+typedef struct statwalk {
+    mtx_t lock;
+    cnd_t wake;
+
+    statlist queue;
+    /*Directories queued or being read. Done when none are left.*/
+    int pending;
+
+    statlist entries;
+    bool nomemory;
+} statwalk;
+
+static char* nicestat_join (const char* dir, const char* name) {
+    size_t dirlength = strlen(dir), namelength = strlen(name);
+    char* path = malloc(dirlength + namelength + 2);
+
+    if (path) {
+        memcpy(path, dir, dirlength);
+        path[dirlength] = '/';
+        memcpy(path + dirlength+1, name, namelength+1);
+    }
+
+    return path;
+}
+
+/*Releases a reference to an open directory. Requires the lock.*/
+static void nicestat_release (statdir* dir) {
+    if (dir && !--dir->refs) {
+        closedir(dir->dir);
+        free(dir);
+    }
+}
+
+/*Opens a directory relative to its parent, leaving it in *opened, and
+  stats each entry relative to it, into a list of them, and a list of
+  the subdirectories to be read in turn*/
+static bool nicestat_readdir (const statqueued* queued, DIR** opened,
+                              statlist* entries, statlist* subdirs) {
+    int parentfd = queued->parent ? dirfd(queued->parent->dir) : AT_FDCWD;
+    /*Not through a symbolic link that has replaced it since its lstat*/
+    int fd = openat(parentfd, queued->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = fd < 0 ? 0 : fdopendir(fd);
+
+    /*Unreadable, so left out*/
+    if (!dir) {
+        if (fd >= 0)
+            close(fd);
+
+        return true;
+    }
+
+    *opened = dir;
+    size_t dirlength = strlen(queued->path);
+
+    for (struct dirent* dirent; (dirent = readdir(dir));) {
+        const char* name = dirent->d_name;
+
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+
+        struct stat st;
+        statentry entry;
+
+        /*Gone since it was listed*/
+        if (nicestat_translate(fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW), st, &entry.stat))
+            continue;
+
+        entry.path = nicestat_join(queued->path, name);
+
+        if (!entry.path)
+            return false;
+
+        /*Once pushed, the entries own the path*/
+        else if (!statlist_push(entries, &entry, sizeof(statentry))) {
+            free(entry.path);
+            return false;
+        }
+
+        statqueued subdir = {.name = entry.path + dirlength+1, .path = entry.path};
+
+        if (entry.stat.mode == file_dir && !statlist_push(subdirs, &subdir, sizeof(statqueued)))
+            return false;
+    }
+
+    return true;
+}
+
+static int nicestat_walkworker (void* ctx) {
+    statwalk* walk = ctx;
+    mtx_lock(&walk->lock);
+
+    for (;;) {
+        while (!walk->queue.length && walk->pending)
+            cnd_wait(&walk->wake, &walk->lock);
+
+        if (!walk->pending)
+            break;
+
+        statqueued dir = ((statqueued*) walk->queue.items)[--walk->queue.length];
+        mtx_unlock(&walk->lock);
+
+        /*Gather a whole directory at a time, to take the lock once for it*/
+        statlist entries = {0}, subdirs = {0};
+        DIR* opened = 0;
+        bool read = nicestat_readdir(&dir, &opened, &entries, &subdirs);
+
+        /*Kept open only if there's anything to open from it*/
+        statdir* self = subdirs.length ? malloc(sizeof(statdir)) : 0;
+
+        if (self)
+            *self = (statdir) {.dir = opened, .refs = 1};
+
+        else if (opened)
+            closedir(opened);
+
+        mtx_lock(&walk->lock);
+        nicestat_release(dir.parent);
+        walk->nomemory |= !read || (subdirs.length && !self);
+
+        for (int i = 0; i < entries.length; i++)
+            walk->nomemory |= !statlist_push(&walk->entries, (statentry*) entries.items + i, sizeof(statentry));
+
+        int queued = 0;
+
+        for (int i = 0; self && i < subdirs.length; i++) {
+            statqueued* subdir = (statqueued*) subdirs.items + i;
+            subdir->parent = self;
+
+            if (statlist_push(&walk->queue, subdir, sizeof(statqueued)))
+                queued++;
+
+            else
+                walk->nomemory = true;
+        }
+
+        /*This one is done, those are to do*/
+        walk->pending += queued - 1;
+
+        if (self) {
+            self->refs += queued;
+            nicestat_release(self);
+        }
+
+        /*Stop descending once out of memory*/
+        if (walk->nomemory) {
+            for (int i = 0; i < walk->queue.length; i++)
+                nicestat_release(((statqueued*) walk->queue.items)[i].parent);
+
+            walk->pending -= walk->queue.length;
+            walk->queue.length = 0;
+        }
+
+        cnd_broadcast(&walk->wake);
+
+        free(entries.items);
+        free(subdirs.items);
+    }
+
+    mtx_unlock(&walk->lock);
+    return 0;
+}
+
+staterr nicestat_walk (const char* root, int threads, statentry** entries, int* n) {
+    *entries = 0;
+    *n = 0;
+
+    statentry rootentry;
+    staterr error = nicelstat(root, &rootentry.stat);
+
+    if (error)
+        return error;
+
+    statwalk walk = {0};
+    rootentry.path = malloc(strlen(root)+1);
+
+    if (   !rootentry.path
+        || !statlist_push(&walk.entries, &rootentry, sizeof(statentry))) {
+        free(rootentry.path);
+        return staterr_nomemory;
+    }
+
+    strcpy(rootentry.path, root);
+
+    if (rootentry.stat.mode == file_dir) {
+        mtx_init(&walk.lock, mtx_plain);
+        cnd_init(&walk.wake);
+
+        statqueued rootdir = {.name = rootentry.path, .path = rootentry.path};
+        walk.pending = 1;
+        walk.nomemory = !statlist_push(&walk.queue, &rootdir, sizeof(statqueued));
+
+        if (!walk.nomemory)
+            threadrun(threads, nicestat_walkworker, &walk);
+
+        mtx_destroy(&walk.lock);
+        cnd_destroy(&walk.wake);
+        free(walk.queue.items);
+    }
+
+    *entries = walk.entries.items;
+    *n = walk.entries.length;
+    return walk.nomemory ? staterr_nomemory : stat_success;
+}
+
+void nicestat_freewalk (statentry* entries, int n) {
+    for (int i = 0; i < n; i++)
+        free(entries[i].path);
+
+    free(entries);
+}
+
 const char* fmode_getstr (fmode mode) {
     switch (mode) {
     case file_regular: return "regular file";
@@ -27,5 +27,37 @@ staterr nicestat (const char* filename, stat_t* result);
 staterr nicelstat (const char* filename, stat_t* result);
 staterr nicefstat (int filedescriptor, stat_t* result);
 
+/*Translate an errno value, from any file operation, into a staterr*/
+staterr nicestat_error (int error);
+
+/**
+ * Stat n files at once, across a pool of threads (the calling one
+ * included), into results[i], with each error in errors[i]. Returns how
+ * many failed. For the many stats that are each mostly syscall latency.
+ */
+int nicestat_batch (const char* const* filenames, int n, stat_t* results, staterr* errors, int threads);
+int nicelstat_batch (const char* const* filenames, int n, stat_t* results, staterr* errors, int threads);
+
+typedef struct statentry {
+    /*The root given, joined with the path under it*/
+    char* path;
+    stat_t stat;
+} statentry;
+
+/**
+ * List a directory and everything under it, with their lstat results, in
+ * one array, the root first, then the rest in no particular order.
+ *
+ * Directories are read by a pool of threads, each opened relative to its
+ * parent (with openat), and their entries stat'd relative to it (with
+ * fstatat), rather than by path from the root. Symbolic links aren't
+ * followed. Directories that can't be read are listed but not descended
+ * into.
+ *
+ * Returns the error stat'ing the root, if any.
+ */
+staterr nicestat_walk (const char* root, int threads, statentry** entries, int* n);
+void nicestat_freewalk (statentry* entries, int n);
+
 /*Translate a file mode into a statically allocated, uncapitalised string*/
 const char* fmode_getstr (fmode mode);
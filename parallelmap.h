@@ -0,0 +1,351 @@
+#pragma once
+
+#include "common.h"
+#include "hashmap.h"
+
+#include <assert.h>
+#include <threads.h>
+
+/**
+ * Bulk merging of several maps (or sets) at once, across threads.
+ *
+ * Rather than adding the elements one by one, as XXXMerge does, this
+ * sizes the destination once for all of them, and divides its slots
+ * into a range per thread by the top bits of each element's first
+ * choice slot. The elements are radix partitioned into these ranges
+ * (counted, then scattered, both in parallel), and each thread then
+ * inserts its own partition into its own range of the table.
+ *
+ * Stored hashes are reused, so no string key is hashed, and only keys
+ * with equal hashes are compared.
+ *
+ * An element whose probe would leave its range (rare, at the default
+ * load) is left to be added normally once the threads have finished.
+ *
+ * The result is as if the sources had been merged in order, so a key
+ * in several takes the value from the last. The destination's own
+ * elements come first. Keys and values are shared, as with XXXMerge.
+ */
+
+static void hashmapMergeParallel (hashmap* dest, const hashmap* const* srcs, int n, int threads);
+static void intmapMergeParallel (intmap* dest, const intmap* const* srcs, int n, int threads);
+static void hashsetMergeParallel (hashset* dest, const hashset* const* srcs, int n, int threads);
+static void intsetMergeParallel (intset* dest, const intset* const* srcs, int n, int threads);
+
+/*==== Inline implementations ====*/
+
+enum {
+    /*Fewer elements than this aren't worth starting threads for*/
+    mapbulk_minPerThread = 1 << 14
+};
+
+typedef struct mapBulk {
+    generalmap* dest;
+    generalmapHash hashf;
+    generalmapCmp cmp;
+
+    /*The tables to take elements from, in order, including old ones
+      still being migrated from, and how many slots in all*/
+    const generalmap** tables;
+    int tableNo;
+    int64_t slots;
+
+    /*One partition per thread, each a range of 1 << partitionShift
+      slots of the destination*/
+    int threads;
+    int partitionShift;
+
+    /*Per thread then partition: elements found, then where to put them*/
+    int* counts;
+    /*The elements, grouped by partition, and where each partition starts*/
+    generalmapSlot* elements;
+    int* starts;
+
+    /*Per partition: new keys added, the furthest probe, and how many
+      elements were left over (moved to the start of its range)*/
+    int* added;
+    int* maxProbe;
+    int* spilled;
+} mapBulk;
+
+typedef struct mapBulkTask {
+    mapBulk* bulk;
+    int n;
+} mapBulkTask;
+
+static inline int mapbulkPartition (const mapBulk* bulk, uint64_t hash) {
+    const generalmap* dest = bulk->dest;
+    int home = dest->layout == maplayout_grouped
+             ? (hash & (dest->size-1)) & ~(mapgroup_width-1)
+             : hash & (dest->size-1);
+    return home >> bulk->partitionShift;
+}
+
+/*Counts (or, if scattering, places) the elements in this thread's share
+  of the source slots, by partition*/
+static inline void mapbulkScan (mapBulk* bulk, int thread, bool scatter) {
+    int64_t from = bulk->slots*thread / bulk->threads;
+    int64_t to = bulk->slots*(thread+1) / bulk->threads;
+    int* counts = bulk->counts + thread*bulk->threads;
+
+    int64_t base = 0;
+
+    for (int n = 0; n < bulk->tableNo; base += bulk->tables[n++]->size) {
+        const generalmap* table = bulk->tables[n];
+        int lower = from > base ? from - base : 0;
+        int upper = to - base < table->size ? to - base : table->size;
+
+        for (int index = lower; index < upper; index++) {
+            if (!generalmapOccupied(table, index))
+                continue;
+
+            uint64_t hash = generalmapSlotHash(table, index, bulk->hashf);
+            int partition = mapbulkPartition(bulk, hash);
+
+            if (scatter)
+                bulk->elements[counts[partition]] = (generalmapSlot) {
+                    .keyStr = generalmapKeyAt(table, index), .hash = hash,
+                    .value = generalmapValueAt(table, index)
+                };
+
+            counts[partition]++;
+        }
+    }
+}
+
+/*Adds a key whose probe stays within the slots [lower, upper), touching
+  nothing outside them, not even the counts of the map. Returns how far
+  it was placed from its first choice, -1 if the key was present, or -2
+  if the probe leaves the range.*/
+static inline int mapbulkAddInRange (generalmap* map, const generalmapSlot* element, generalmapCmp cmp,
+                                     int lower, int upper) {
+    uint64_t hash = element->hash;
+
+    if (map->layout != maplayout_grouped) {
+        int mask = map->size-1;
+
+        for (int distance = 0; ; distance++) {
+            int index = (hash + distance) & mask;
+
+            if (index < lower || index >= upper)
+                return -2;
+
+            else if (!generalmapOccupied(map, index)) {
+                generalmapSetAt(map, index, element->keyStr, hash, element->value);
+                return distance;
+
+            } else if (generalmapIsMatch(map, index, element->keyStr, hash, cmp)) {
+                generalmapSetValueAt(map, index, element->value);
+                return -1;
+            }
+        }
+    }
+
+    /*As generalmapFindGrouped and generalmapFindEmptyGrouped, together.
+      A new table has no tombstones.*/
+    int groupmask = map->size/mapgroup_width - 1;
+    int group = (hash / mapgroup_width) & groupmask;
+    uint8_t tag = hash >> 57;
+
+    for (int distance = 0; ; distance++) {
+        group = (group + distance) & groupmask;
+        int start = group*mapgroup_width;
+        const uint8_t* ctrl = map->ctrl + start;
+
+        if (start < lower || start >= upper)
+            return -2;
+
+        for (unsigned match = generalmapGroupMatch(ctrl, tag); match; match &= match-1) {
+            int index = start + __builtin_ctz(match);
+
+            if (generalmapIsMatch(map, index, element->keyStr, hash, cmp)) {
+                generalmapSetValueAt(map, index, element->value);
+                return -1;
+            }
+        }
+
+        unsigned empty = generalmapGroupEmpty(ctrl);
+
+        if (empty) {
+            generalmapSetAt(map, start + __builtin_ctz(empty), element->keyStr, hash, element->value);
+            return distance;
+        }
+    }
+}
+
+static inline void mapbulkInsert (mapBulk* bulk, int partition) {
+    int lower = partition << bulk->partitionShift;
+    int upper = (partition+1) << bulk->partitionShift;
+
+    generalmapSlot* elements = bulk->elements + bulk->starts[partition];
+    int length = bulk->starts[partition+1] - bulk->starts[partition];
+    int added = 0, maxProbe = 0, spilled = 0;
+
+    for (int i = 0; i < length; i++) {
+        int distance = mapbulkAddInRange(bulk->dest, &elements[i], bulk->cmp, lower, upper);
+
+        if (distance >= 0) {
+            added++;
+
+            if (distance > maxProbe)
+                maxProbe = distance;
+
+        /*Keep the leftovers in order, for later*/
+        } else if (distance == -2)
+            elements[spilled++] = elements[i];
+    }
+
+    bulk->added[partition] = added;
+    bulk->maxProbe[partition] = maxProbe;
+    bulk->spilled[partition] = spilled;
+}
+
+static inline int mapbulkCount (void* task) {
+    mapbulkScan(((mapBulkTask*) task)->bulk, ((mapBulkTask*) task)->n, false);
+    return 0;
+}
+
+static inline int mapbulkScatter (void* task) {
+    mapbulkScan(((mapBulkTask*) task)->bulk, ((mapBulkTask*) task)->n, true);
+    return 0;
+}
+
+static inline int mapbulkBuild (void* task) {
+    mapbulkInsert(((mapBulkTask*) task)->bulk, ((mapBulkTask*) task)->n);
+    return 0;
+}
+
+/*Runs a phase on every thread, the calling one included, and waits*/
+static inline void mapbulkRun (mapBulk* bulk, thrd_start_t phase) {
+    assert(bulk->threads > 0);
+
+    mapBulkTask* tasks = malloc(bulk->threads*sizeof(mapBulkTask));
+    thrd_t* threads = malloc(bulk->threads*sizeof(thrd_t));
+    bool* started = calloc(bulk->threads, sizeof(bool));
+
+    for (int n = 0; n < bulk->threads; n++)
+        tasks[n] = (mapBulkTask) {bulk, n};
+
+    for (int n = 1; n < bulk->threads; n++)
+        started[n] = thrd_create(&threads[n], phase, &tasks[n]) == thrd_success;
+
+    /*Do any that couldn't be started here*/
+    for (int n = 0; n < bulk->threads; n++)
+        if (!started[n])
+            phase(&tasks[n]);
+
+    for (int n = 1; n < bulk->threads; n++)
+        if (started[n])
+            thrd_join(threads[n], 0);
+
+    free(tasks);
+    free(threads);
+    free(started);
+}
+
+static inline void generalmapMergeParallel (generalmap* dest, const generalmap* const* srcs, int n, int threads,
+                                            generalmapHash hashf, generalmapCmp cmp) {
+    mapBulk bulk = {.hashf = hashf, .cmp = cmp};
+
+    /*Gather the tables, and how many elements at most*/
+    bulk.tables = malloc(2*(n+1)*sizeof(generalmap*));
+    int elements = 0;
+
+    for (int i = -1; i < n; i++) {
+        const generalmap* src = i < 0 ? dest : srcs[i];
+        assert(src != dest || i < 0);
+
+        for (; src; src = src->old) {
+            bulk.tables[bulk.tableNo++] = src;
+            bulk.slots += src->size;
+        }
+
+        elements += i < 0 ? dest->elements : srcs[i]->elements;
+    }
+
+    /*A new table big enough for all of them*/
+    generalmap newmap = generalmapInitLike(dest, generalmapSizeFor(dest, elements));
+    bulk.dest = &newmap;
+
+    /*A power of two threads, each with a range of at least a group*/
+    int maxThreads = elements / mapbulk_minPerThread;
+    threads = threads < maxThreads ? threads : maxThreads;
+    bulk.threads = 1;
+
+    while (   bulk.threads*2 <= threads
+           && (newmap.size / (bulk.threads*2)) >= mapgroup_width)
+        bulk.threads *= 2;
+
+    bulk.partitionShift = logi(newmap.size / bulk.threads, 2);
+
+    int partitions = bulk.threads;
+    bulk.counts = calloc(bulk.threads*partitions, sizeof(int));
+    bulk.starts = malloc((partitions+1)*sizeof(int));
+    bulk.added = malloc(partitions*sizeof(int));
+    bulk.maxProbe = malloc(partitions*sizeof(int));
+    bulk.spilled = malloc(partitions*sizeof(int));
+
+    mapbulkRun(&bulk, mapbulkCount);
+
+    /*Turn the counts into where each thread's elements of each partition
+      go: by partition, then thread, which keeps them in source order*/
+    int at = 0;
+
+    for (int partition = 0; partition < partitions; partition++) {
+        bulk.starts[partition] = at;
+
+        for (int thread = 0; thread < bulk.threads; thread++) {
+            int count = bulk.counts[thread*partitions + partition];
+            bulk.counts[thread*partitions + partition] = at;
+            at += count;
+        }
+    }
+
+    bulk.starts[partitions] = at;
+    bulk.elements = malloc(at*sizeof(generalmapSlot));
+
+    mapbulkRun(&bulk, mapbulkScatter);
+    mapbulkRun(&bulk, mapbulkBuild);
+
+    for (int partition = 0; partition < partitions; partition++) {
+        newmap.elements += bulk.added[partition];
+
+        if (bulk.maxProbe[partition] > newmap.maxProbe)
+            newmap.maxProbe = bulk.maxProbe[partition];
+    }
+
+    /*The leftovers, in order. Partitions are ranges of the table, so the
+      order between different ones doesn't matter.*/
+    for (int partition = 0; partition < partitions; partition++)
+        for (int i = 0; i < bulk.spilled[partition]; i++) {
+            generalmapSlot* element = &bulk.elements[bulk.starts[partition] + i];
+            generalmapAddHashed(&newmap, element->keyStr, element->hash, element->value, hashf, cmp, true);
+        }
+
+    free(bulk.tables);
+    free(bulk.counts);
+    free(bulk.starts);
+    free(bulk.added);
+    free(bulk.maxProbe);
+    free(bulk.spilled);
+    free(bulk.elements);
+
+    generalmapFree(dest, true);
+    *dest = newmap;
+}
+
+static inline void hashmapMergeParallel (hashmap* dest, const hashmap* const* srcs, int n, int threads) {
+    generalmapMergeParallel(dest, srcs, n, threads, hashstr, strcmp);
+}
+
+static inline void intmapMergeParallel (intmap* dest, const intmap* const* srcs, int n, int threads) {
+    generalmapMergeParallel(dest, srcs, n, threads, generalmapHashInt, 0);
+}
+
+static inline void hashsetMergeParallel (hashset* dest, const hashset* const* srcs, int n, int threads) {
+    generalmapMergeParallel(dest, srcs, n, threads, hashstr, strcmp);
+}
+
+static inline void intsetMergeParallel (intset* dest, const intset* const* srcs, int n, int threads) {
+    generalmapMergeParallel(dest, srcs, n, threads, generalmapHashInt, 0);
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+#include "common.h"
+#include "hashmap.h"
+#include "vector.h"
+
+#include <stdatomic.h>
+#include <threads.h>
+
+/**
+ * A hashmap for sharing between threads that read it far more often than
+ * they write to it.
+ *
+ * Readers never block or lock. Each lookup happens against an immutable
+ * version of the map. Writers (serialized by a mutex) copy the current
+ * version, change the copy, and publish it with a single atomic store.
+ *
+ * Old versions are freed once no reader can still be using them, tracked
+ * by epochs: each reader announces the epoch it started in, and a version
+ * retired in an epoch is freed when every active reader started after it.
+ *
+ * Each reading thread needs its own reader id, from rcuhashmapRegister.
+ *
+ * As with hashmap, the keys and values are owned by the caller. One that
+ * is removed or replaced may still be in use by a reader, until the
+ * writer that did so has returned and every reader has exited since.
+ */
+
+typedef struct rcumapReader {
+    /*The epoch it entered in, or 0 if not reading.
+      A cache line each, so readers don't contend.*/
+    _Alignas(64) _Atomic uint64_t epoch;
+} rcumapReader;
+
+typedef struct rcumapVersion {
+    hashmap map;
+    /*The epoch it was replaced in*/
+    uint64_t retiredIn;
+} rcumapVersion;
+
+typedef struct rcuhashmap {
+    _Atomic(rcumapVersion*) current;
+    _Atomic uint64_t epoch;
+
+    int maxReaders;
+    _Atomic int readerCount;
+    rcumapReader* readers;
+
+    mtx_t writelock;
+    /*Versions replaced but not yet freed. Only touched by writers.*/
+    vector(rcumapVersion*) retired;
+} rcuhashmap;
+
+/**
+ * Room for up to maxReaders threads to be registered over its lifetime.
+ * Returns null if out of memory.
+ */
+static rcuhashmap* rcuhashmapInit (rcuhashmap* map, int size, int maxReaders);
+
+/**
+ * Frees every version. No other thread may be using it.
+ */
+static rcuhashmap* rcuhashmapFree (rcuhashmap* map);
+
+/*==== Readers ====*/
+
+/*Returns a reader id for the calling thread to use, or -1 once all
+  maxReaders have been given out, in which case it mustn't read*/
+static int rcuhashmapRegister (rcuhashmap* map);
+
+/**
+ * Pin the current version for a series of lookups with the normal
+ * hashmap functions. It remains valid, and unchanged, until
+ * rcuhashmapExit. Don't nest these.
+ */
+static const hashmap* rcuhashmapEnter (rcuhashmap* map, int reader);
+static void rcuhashmapExit (rcuhashmap* map, int reader);
+
+static void* rcuhashmapMap (rcuhashmap* map, int reader, const char* key);
+static bool rcuhashmapTest (rcuhashmap* map, int reader, const char* key);
+
+/*==== Writers ====*/
+
+/*Returns whether the key was already present*/
+static bool rcuhashmapAdd (rcuhashmap* map, const char* key, void* value);
+static bool rcuhashmapRemove (rcuhashmap* map, const char* key);
+
+/**
+ * Publish a whole new version at once, e.g. for many changes. The map
+ * takes ownership of it.
+ */
+static void rcuhashmapPublish (rcuhashmap* map, hashmap replacement);
+
+/*==== Inline implementations ====*/
+
+/*Null if out of memory, leaving the map to the caller*/
+static inline rcumapVersion* rcumapVersionInit (hashmap map) {
+    rcumapVersion* version = malloc(sizeof(rcumapVersion));
+
+    if (version)
+        *version = (rcumapVersion) {.map = map};
+
+    return version;
+}
+
+static inline void rcumapVersionFree (rcumapVersion* version) {
+    hashmapFree(&version->map);
+    free(version);
+}
+
+static inline rcuhashmap* rcuhashmapInit (rcuhashmap* map, int size, int maxReaders) {
+    hashmap initial = hashmapInit(size, calloc);
+    rcumapVersion* current = rcumapVersionInit(initial);
+    /*Aligned, as calloc only aligns for max_align_t, so that each reader
+      really has a line to itself. Its size is a multiple of that.*/
+    rcumapReader* readers = aligned_alloc(_Alignof(rcumapReader),
+                                          (maxReaders > 0 ? maxReaders : 1)*sizeof(rcumapReader));
+
+    if (!current || !readers) {
+        hashmapFree(&initial);
+        free(current);
+        free(readers);
+        return 0;
+    }
+
+    atomic_init(&map->current, current);
+    /*0 means not reading*/
+    atomic_init(&map->epoch, 1);
+
+    map->maxReaders = maxReaders;
+    atomic_init(&map->readerCount, 0);
+    map->readers = readers;
+
+    for (int i = 0; i < maxReaders; i++)
+        atomic_init(&map->readers[i].epoch, 0);
+
+    mtx_init(&map->writelock, mtx_plain);
+    map->retired = vectorInit(4, malloc);
+
+    return map;
+}
+
+static inline rcuhashmap* rcuhashmapFree (rcuhashmap* map) {
+    vectorFreeObjs(&map->retired, (vectorDtor) rcumapVersionFree);
+    rcumapVersionFree(atomic_load(&map->current));
+
+    mtx_destroy(&map->writelock);
+    free(map->readers);
+    map->readers = 0;
+
+    return map;
+}
+
+static inline int rcuhashmapRegister (rcuhashmap* map) {
+    int reader = atomic_load(&map->readerCount);
+
+    /*Never count past the slots there are*/
+    do {
+        if (reader >= map->maxReaders)
+            return -1;
+    } while (!atomic_compare_exchange_weak(&map->readerCount, &reader, reader+1));
+
+    return reader;
+}
+
+static inline const hashmap* rcuhashmapEnter (rcuhashmap* map, int reader) {
+    /*Announce before loading the version. A writer that saw us idle
+      (and so may free the version it replaced) had already published
+      the new one, and so that's the one we'll see.*/
+    atomic_store(&map->readers[reader].epoch, atomic_load(&map->epoch));
+    return &atomic_load(&map->current)->map;
+}
+
+static inline void rcuhashmapExit (rcuhashmap* map, int reader) {
+    atomic_store_explicit(&map->readers[reader].epoch, 0, memory_order_release);
+}
+
+static inline void* rcuhashmapMap (rcuhashmap* map, int reader, const char* key) {
+    void* value = hashmapMap(rcuhashmapEnter(map, reader), key);
+    rcuhashmapExit(map, reader);
+    return value;
+}
+
+static inline bool rcuhashmapTest (rcuhashmap* map, int reader, const char* key) {
+    void* value;
+    bool present = hashmapTryGet(rcuhashmapEnter(map, reader), key, &value);
+    rcuhashmapExit(map, reader);
+    return present;
+}
+
+/*Frees the retired versions no reader can be using. Requires the lock.*/
+static inline void rcuhashmapReclaim (rcuhashmap* map) {
+    /*The earliest epoch any reader is still in*/
+    uint64_t oldest = UINT64_MAX;
+    int readers = atomic_load(&map->readerCount);
+
+    for (int i = 0; i < readers; i++) {
+        uint64_t epoch = atomic_load(&map->readers[i].epoch);
+
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    /*Retired in an epoch before any active reader started*/
+    for (int i = 0; i < map->retired.length; ) {
+        rcumapVersion* version = map->retired.buffer[i];
+
+        if (version->retiredIn < oldest) {
+            vectorRemoveReorder(&map->retired, i);
+            rcumapVersionFree(version);
+
+        } else
+            i++;
+    }
+}
+
+/*Swap in a new version, retiring the old. Requires the lock.*/
+static inline void rcuhashmapSwap (rcuhashmap* map, rcumapVersion* version) {
+    rcumapVersion* old = atomic_exchange(&map->current, version);
+
+    /*Readers in this epoch or earlier might have the old version*/
+    old->retiredIn = atomic_fetch_add(&map->epoch, 1);
+    vectorPush(&map->retired, old);
+
+    rcuhashmapReclaim(map);
+}
+
+static inline bool rcuhashmapAdd (rcuhashmap* map, const char* key, void* value) {
+    mtx_lock(&map->writelock);
+
+    rcumapVersion* version = rcumapVersionInit(mapDup(&atomic_load(&map->current)->map));
+    bool present = hashmapAdd(&version->map, key, value);
+    rcuhashmapSwap(map, version);
+
+    mtx_unlock(&map->writelock);
+    return present;
+}
+
+static inline bool rcuhashmapRemove (rcuhashmap* map, const char* key) {
+    mtx_lock(&map->writelock);
+
+    /*Only make a new version if there's something to change*/
+    const hashmap* current = &atomic_load(&map->current)->map;
+    void* value;
+    bool present = hashmapTryGet(current, key, &value);
+
+    if (present) {
+        rcumapVersion* version = rcumapVersionInit(mapDup(current));
+        hashmapRemove(&version->map, key);
+        rcuhashmapSwap(map, version);
+    }
+
+    mtx_unlock(&map->writelock);
+    return present;
+}
+
+static inline void rcuhashmapPublish (rcuhashmap* map, hashmap replacement) {
+    rcumapVersion* version = rcumapVersionInit(replacement);
+
+    mtx_lock(&map->writelock);
+    rcuhashmapSwap(map, version);
+    mtx_unlock(&map->writelock);
+}
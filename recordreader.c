@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 199309L
+#include "recordreader.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+recordreader* recordreaderInit (recordreader* reader, FILE* file, char delimiter,
+                                size_t bufferSize, allocator alloc) {
+    bufferSize = bufferSize ? bufferSize : recordreader_defaultSize;
+
+    *reader = (recordreader) {
+        .file = file,
+        .fd = -1,
+        .delimiter = delimiter,
+        .buffer = allocatorMalloc(&alloc, bufferSize+1),
+        .capacity = bufferSize,
+        .alloc = alloc
+    };
+
+    if (!reader->buffer) {
+        reader->eof = true;
+        reader->error = staterr_nomemory;
+    }
+
+    return reader;
+}
+
+recordreader* recordreaderInitFd (recordreader* reader, int filedescriptor, char delimiter,
+                                  size_t bufferSize, allocator alloc) {
+    recordreaderInit(reader, 0, delimiter, bufferSize, alloc);
+    reader->fd = filedescriptor;
+    return reader;
+}
+
+recordreader* recordreaderFree (recordreader* reader) {
+    if (reader->buffer)
+        allocatorFree(&reader->alloc, reader->buffer, reader->capacity+1);
+
+    if (reader->spill)
+        allocatorFree(&reader->alloc, reader->spill, reader->spillCapacity);
+
+    reader->buffer = reader->spill = 0;
+    reader->capacity = reader->spillCapacity = 0;
+    return reader;
+}
+
+/*Fills the buffer after the unread data, setting eof if there's no more*/
+static void recordreader_fill (recordreader* reader) {
+    size_t space = reader->capacity - reader->end;
+    size_t bytes;
+
+    if (reader->file) {
+        bytes = fread(reader->buffer + reader->end, 1, space, reader->file);
+
+        if (bytes == 0 && ferror(reader->file))
+            reader->error = staterr_other;
+
+    } else {
+        ssize_t got;
+
+        do {
+            got = read(reader->fd, reader->buffer + reader->end, space);
+        } while (got < 0 && errno == EINTR);
+
+        if (got < 0)
+            reader->error = nicestat_error(errno);
+
+        bytes = got < 0 ? 0 : got;
+    }
+
+    reader->eof = bytes == 0;
+    reader->end += bytes;
+}
+
+/*Appends to the spill buffer, keeping room for a terminator*/
+static bool recordreader_spill (recordreader* reader, const char* data, size_t length) {
+    size_t needed = reader->spillLength + length + 1;
+
+    if (needed > reader->spillCapacity) {
+        size_t capacity = reader->spillCapacity ? reader->spillCapacity : reader->capacity;
+
+        while (capacity < needed)
+            capacity *= 2;
+
+        char* spill = allocatorRealloc(&reader->alloc, reader->spill, reader->spillCapacity, capacity);
+
+        if (!spill) {
+            reader->error = staterr_nomemory;
+            reader->eof = true;
+            return false;
+        }
+
+        reader->spill = spill;
+        reader->spillCapacity = capacity;
+    }
+
+    memcpy(reader->spill + reader->spillLength, data, length);
+    reader->spillLength += length;
+    return true;
+}
+
+/*Gives buffer[at, at+length) as the record, or the whole spill if there is one*/
+static bool recordreader_yield (recordreader* reader, size_t length, record* result) {
+    char* data = reader->buffer + reader->at;
+
+    if (reader->spillLength) {
+        if (!recordreader_spill(reader, data, length))
+            return false;
+
+        data = reader->spill;
+        length = reader->spillLength;
+    }
+
+    data[length] = 0;
+    *result = (record) {data, length};
+    return true;
+}
+
+bool recordreaderNext (recordreader* reader, record* result) {
+    if (!reader->buffer)
+        return false;
+
+    /*The last record's spill is done with*/
+    reader->spillLength = 0;
+
+    for (;;) {
+        size_t unread = reader->end - reader->at;
+        const char* delimiter = memchr(reader->buffer + reader->at, reader->delimiter, unread);
+
+        if (delimiter) {
+            size_t length = delimiter - (reader->buffer + reader->at);
+            bool yielded = recordreader_yield(reader, length, result);
+            reader->at += length+1;
+            return yielded;
+
+        /*The last record, without a delimiter*/
+        } else if (reader->eof) {
+            if (unread == 0 && reader->spillLength == 0)
+                return false;
+
+            bool yielded = recordreader_yield(reader, unread, result);
+            reader->at = reader->end;
+            return yielded;
+        }
+
+        /*Make room, by moving the partial record to the start, or if it
+          fills the buffer, out to the spill buffer*/
+        if (unread == reader->capacity) {
+            if (!recordreader_spill(reader, reader->buffer, unread))
+                return false;
+
+            unread = 0;
+
+        } else
+            memmove(reader->buffer, reader->buffer + reader->at, unread);
+
+        reader->at = 0;
+        reader->end = unread;
+        recordreader_fill(reader);
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "common.h"
+#include "nicestat.h"
+
+/**
+ * Reads lines, or records ending in any other delimiter, from a FILE* or
+ * a file descriptor, however large, through one fixed buffer.
+ *
+ * Each record is given as a view into the buffer, with no allocation or
+ * copy, valid until the next is read. The delimiter is found by memchr,
+ * which libc vectorizes. When the buffer runs out, the partial record at
+ * its end is moved to the start and the rest refilled.
+ *
+ * A record that doesn't fit in the buffer at all is assembled in a spill
+ * buffer instead, from the allocator, which grows as needed and is kept
+ * for the next.
+ *
+ * Records are null terminated, in place of their delimiter. The last
+ * needn't have a delimiter.
+ */
+
+typedef struct record {
+    const char* data;
+    size_t length;
+} record;
+
+typedef struct recordreader {
+    /*The source, the file if there is one, otherwise the descriptor*/
+    FILE* file;
+    int fd;
+    char delimiter;
+
+    /*The unread data is buffer[at, end), with a byte spare after the
+      capacity for a terminator*/
+    char* buffer;
+    size_t capacity, at, end;
+    bool eof;
+    /*Any error reading, which also ends the input*/
+    staterr error;
+
+    /*The part of an overlong record read so far*/
+    char* spill;
+    size_t spillLength, spillCapacity;
+
+    allocator alloc;
+} recordreader;
+
+enum {
+    recordreader_defaultSize = 64*1024
+};
+
+/**
+ * The buffer size is the size up to which records aren't copied, and
+ * should be several times a typical record. 0 gives the default.
+ */
+recordreader* recordreaderInit (recordreader* reader, FILE* file, char delimiter,
+                                size_t bufferSize, allocator alloc);
+recordreader* recordreaderInitFd (recordreader* reader, int filedescriptor, char delimiter,
+                                  size_t bufferSize, allocator alloc);
+
+/*Frees the buffers, but doesn't close the source*/
+recordreader* recordreaderFree (recordreader* reader);
+
+/*Reads the next record, returning false at the end of the input*/
+bool recordreaderNext (recordreader* reader, record* result);
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "common.h"
+#include "hashmap.h"
+
+#include <assert.h>
+#include <threads.h>
+
+/**
+ * A hashmap for many threads to add to at once.
+ *
+ * Keys are partitioned by their hash into a power of two number of
+ * shards, each an independent hashmap behind its own lock, so threads
+ * only contend when they touch the same shard. Keys are hashed outside
+ * of the lock, and only once.
+ *
+ * The shard is picked by the bits of the hash just below the 7 that the
+ * grouped layout uses as tags, so that neither the tags nor the slot
+ * index within a shard lose any of theirs.
+ *
+ * The aggregate operations (Size, Merge, Iterate) lock one shard at a
+ * time, so they see each shard consistently but not the whole map at
+ * one moment, if other threads are writing to it.
+ *
+ * Ownership of keys and values is as with hashmap.
+ */
+
+typedef struct mapShard {
+    /*A cache line each, so that locking one doesn't slow its neighbours*/
+    _Alignas(64) mtx_t lock;
+    hashmap map;
+} mapShard;
+
+typedef struct shardhashmap {
+    int shardBits;
+    mapShard* shards;
+} shardhashmap;
+
+typedef void (*shardhashmapIter)(const char* key, void* value, void* ctx);
+
+/**
+ * The size is of the whole map, divided between the shards. The number
+ * of shards is rounded up to a power of two, and should be a few times
+ * the number of threads writing at once.
+ */
+static shardhashmap* shardhashmapInit (shardhashmap* map, int size, int shards, maplayout layout);
+
+/**
+ * No other thread may be using it.
+ */
+static shardhashmap* shardhashmapFree (shardhashmap* map);
+static shardhashmap* shardhashmapFreeObjs (shardhashmap* map, hashmapKeyDtor keyDtor, hashmapValueDtor valueDtor);
+
+static bool shardhashmapAdd (shardhashmap* map, const char* key, void* value);
+static void* shardhashmapMap (shardhashmap* map, const char* key);
+static bool shardhashmapTryGet (shardhashmap* map, const char* key, void** value);
+static bool shardhashmapRemove (shardhashmap* map, const char* key);
+
+/*The number of elements, summed over the shards*/
+static int shardhashmapSize (shardhashmap* map);
+
+/**
+ * Adds every element of src to dest, using the same keys and values.
+ * Shard by shard when they have the same number. Keys are never
+ * rehashed. Don't merge two maps into each other at the same time.
+ */
+static void shardhashmapMerge (shardhashmap* dest, shardhashmap* src);
+
+/*Adds every element of a plain hashmap*/
+static void shardhashmapMergeMap (shardhashmap* dest, const hashmap* src);
+
+/**
+ * Calls the function on each element, holding the lock of its shard.
+ * It must not use the map itself.
+ */
+static void shardhashmapIterate (shardhashmap* map, shardhashmapIter iter, void* ctx);
+
+/*==== Inline implementations ====*/
+
+static inline shardhashmap* shardhashmapInit (shardhashmap* map, int size, int shards, maplayout layout) {
+    map->shardBits = logi(pow2ize(shards), 2);
+    shards = 1 << map->shardBits;
+
+    /*Tags are hash >> 57, so leave those bits to the map in each shard*/
+    assert(map->shardBits <= 16);
+
+    map->shards = aligned_alloc(_Alignof(mapShard), shards*sizeof(mapShard));
+
+    for (int i = 0; i < shards; i++) {
+        mtx_init(&map->shards[i].lock, mtx_plain);
+        map->shards[i].map = hashmapInitLayout(intdiv_roundup(size, shards), calloc, layout);
+    }
+
+    return map;
+}
+
+static inline shardhashmap* shardhashmapFreeObjs (shardhashmap* map, hashmapKeyDtor keyDtor, hashmapValueDtor valueDtor) {
+    for (int i = 0; i < 1 << map->shardBits; i++) {
+        hashmapFreeObjs(&map->shards[i].map, keyDtor, valueDtor);
+        mtx_destroy(&map->shards[i].lock);
+    }
+
+    free(map->shards);
+    map->shards = 0;
+    return map;
+}
+
+static inline shardhashmap* shardhashmapFree (shardhashmap* map) {
+    return shardhashmapFreeObjs(map, 0, 0);
+}
+
+static inline mapShard* shardhashmapShard (const shardhashmap* map, uint64_t hash) {
+    return &map->shards[(hash >> (57 - map->shardBits)) & ((1 << map->shardBits) - 1)];
+}
+
+static inline bool shardhashmapAdd (shardhashmap* map, const char* key, void* value) {
+    uint64_t hash = hashstr(key);
+    mapShard* shard = shardhashmapShard(map, hash);
+
+    mtx_lock(&shard->lock);
+    bool present = generalmapAddHashed(&shard->map, key, hash, value, hashstr, strcmp, true);
+    mtx_unlock(&shard->lock);
+
+    return present;
+}
+
+static inline bool shardhashmapTryGet (shardhashmap* map, const char* key, void** value) {
+    uint64_t hash = hashstr(key);
+    mapShard* shard = shardhashmapShard(map, hash);
+
+    mtx_lock(&shard->lock);
+    bool present = generalmapTryGetHashed(&shard->map, key, hash, value, strcmp);
+    mtx_unlock(&shard->lock);
+
+    return present;
+}
+
+static inline void* shardhashmapMap (shardhashmap* map, const char* key) {
+    void* value;
+    return shardhashmapTryGet(map, key, &value) ? value : 0;
+}
+
+static inline bool shardhashmapRemove (shardhashmap* map, const char* key) {
+    uint64_t hash = hashstr(key);
+    mapShard* shard = shardhashmapShard(map, hash);
+
+    mtx_lock(&shard->lock);
+    bool present = generalmapRemoveHashed(&shard->map, key, hash, hashstr, strcmp);
+    mtx_unlock(&shard->lock);
+
+    return present;
+}
+
+static inline int shardhashmapSize (shardhashmap* map) {
+    int size = 0;
+
+    for (int i = 0; i < 1 << map->shardBits; i++) {
+        mtx_lock(&map->shards[i].lock);
+        size += map->shards[i].map.elements;
+        mtx_unlock(&map->shards[i].lock);
+    }
+
+    return size;
+}
+
+/*Adds each element of a map, whose hashes are stored, without rehashing*/
+static inline void shardhashmapMergeTable (shardhashmap* dest, const hashmap* src) {
+    for (int index = 0; index < src->size; index++) {
+        if (!generalmapOccupied(src, index))
+            continue;
+
+        const char* key = generalmapKeyAt(src, index);
+        uint64_t hash = generalmapHashAt(src, index);
+        mapShard* shard = shardhashmapShard(dest, hash);
+
+        mtx_lock(&shard->lock);
+        generalmapAddHashed(&shard->map, key, hash, generalmapValueAt(src, index), hashstr, strcmp, true);
+        mtx_unlock(&shard->lock);
+    }
+
+    if (src->old)
+        shardhashmapMergeTable(dest, src->old);
+}
+
+/*Adds each element of a map into a single shard*/
+static inline void shardhashmapMergeShard (hashmap* dest, const hashmap* src) {
+    for (int index = 0; index < src->size; index++)
+        if (generalmapOccupied(src, index))
+            generalmapAddHashed(dest, generalmapKeyAt(src, index), generalmapHashAt(src, index),
+                                generalmapValueAt(src, index), hashstr, strcmp, true);
+
+    if (src->old)
+        shardhashmapMergeShard(dest, src->old);
+}
+
+static inline void shardhashmapMergeMap (shardhashmap* dest, const hashmap* src) {
+    shardhashmapMergeTable(dest, src);
+}
+
+static inline void shardhashmapMerge (shardhashmap* dest, shardhashmap* src) {
+    assert(dest != src);
+
+    for (int i = 0; i < 1 << src->shardBits; i++) {
+        mapShard* shard = &src->shards[i];
+        mtx_lock(&shard->lock);
+
+        /*Every key of this shard belongs in the same one of dest*/
+        if (dest->shardBits == src->shardBits) {
+            mtx_lock(&dest->shards[i].lock);
+            shardhashmapMergeShard(&dest->shards[i].map, &shard->map);
+            mtx_unlock(&dest->shards[i].lock);
+
+        } else
+            shardhashmapMergeTable(dest, &shard->map);
+
+        mtx_unlock(&shard->lock);
+    }
+}
+
+static inline void shardhashmapIterateTable (const hashmap* map, shardhashmapIter iter, void* ctx) {
+    for (int index = 0; index < map->size; index++)
+        if (generalmapOccupied(map, index))
+            iter(generalmapKeyAt(map, index), generalmapValueAt(map, index), ctx);
+
+    if (map->old)
+        shardhashmapIterateTable(map->old, iter, ctx);
+}
+
+static inline void shardhashmapIterate (shardhashmap* map, shardhashmapIter iter, void* ctx) {
+    for (int i = 0; i < 1 << map->shardBits; i++) {
+        mtx_lock(&map->shards[i].lock);
+        shardhashmapIterateTable(&map->shards[i].map, iter, ctx);
+        mtx_unlock(&map->shards[i].lock);
+    }
+}
@@ -0,0 +1,20 @@
+#include "threadrun.h"
+
+#include <stdlib.h>
+#include <threads.h>
+
+void threadrun (int threads, int (*worker)(void* ctx), void* ctx) {
+    thrd_t* workers = malloc((threads > 1 ? threads-1 : 1)*sizeof(thrd_t));
+    int started = 0;
+
+    for (; started < threads-1; started++)
+        if (!workers || thrd_create(&workers[started], worker, ctx) != thrd_success)
+            break;
+
+    worker(ctx);
+
+    for (int i = 0; i < started; i++)
+        thrd_join(workers[i], 0);
+
+    free(workers);
+}
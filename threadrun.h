@@ -0,0 +1,11 @@
+#pragma once
+
+/*Internal, shared by nicestat.c and fileviewbatch.c. Not part of either's
+  interface, so not to be included from another header.*/
+
+/**
+ * Runs worker(ctx) on each of up to threads threads, the calling one
+ * included, and waits for them all. Any that can't be started are left
+ * out, so it always runs at least once, on the calling thread.
+ */
+void threadrun (int threads, int (*worker)(void* ctx), void* ctx);
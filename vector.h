@@ -5,6 +5,9 @@
 typedef struct vector {
     int length, capacity;
     void** buffer;
+    /*If not null, used for every (re)allocation and free of the buffer,
+      instead of the functions given*/
+    const allocator* alloc;
 } vector;
 
 #define vector(t) vector
@@ -19,6 +22,9 @@ typedef void* (*vectorMapper)(void*);
 
 static vector vectorInit (int initialCapacity, malloc_t malloc);
 
+/**Allocate from an allocator, which must outlive the vector*/
+static vector vectorInitAlloc (int initialCapacity, const allocator* alloc);
+
 /**Clean up resources allocated by the vector but not the vector itself.
    This is safe to call on a null (all zero, uninitialized) vector*/
 static vector* vectorFree (vector* v);
@@ -81,7 +87,7 @@ static bool vectorSet (vector* v, int n, void* value);
 
 #define for_vector_indexed(index, namedecl, vec, continuation)  \
     do {                                                        \
-        vector for_vector_vec__ = (vec);                        \
+        __typeof__(vec) for_vector_vec__ = (vec);               \
         for (int (index) = 0;                                   \
              (index) < for_vector_vec__.length;                 \
              (index)++) {                                       \
@@ -92,7 +98,7 @@ static bool vectorSet (vector* v, int n, void* value);
 
 #define for_vector(namedecl, vec, continuation)              \
     do {                                                     \
-        vector for_vector_vec__ = (vec);                     \
+        __typeof__(vec) for_vector_vec__ = (vec);            \
         for (int n = 0; n < for_vector_vec__.length; n++) {  \
             namedecl = for_vector_vec__.buffer[n];           \
             {continuation}                                   \
@@ -101,7 +107,7 @@ static bool vectorSet (vector* v, int n, void* value);
 
 #define for_vector_reverse(namedecl, vec, continuation)  \
     do {                                                 \
-        vector for_vector_vec__ = (vec);                 \
+        __typeof__(vec) for_vector_vec__ = (vec);        \
         for (int n = for_vector_vec__.length; n; n--) {  \
             namedecl = for_vector_vec__.buffer[n-1];     \
             {continuation}                               \
@@ -115,6 +121,30 @@ static void vectorMap (vector* dest, void* (*f)(void*), vector src);
 
 static vector vectorMapInit (void* (*f)(void*), vector src, malloc_t malloc);
 
+/**Define a vector that stores elements of type T inline, rather than as
+   void* pointers, for name a new typedef (e.g. DEFINE_VECTOR(intvector, int)).
+   It has the same interface as vector, with functions prefixed by the
+   name, taking and returning T:
+     nameInit, nameInitAlloc, nameFree, nameFreeObjs, nameDup, nameNull,
+     nameGet, nameTop, nameResize, namePush, namePushFromArray, namePop,
+     nameRemoveReorder, nameSet, nameMap
+   and also nameAt, a pointer to an element (or null if out of range),
+   for changing it in place. The for_vector macros work with it too.
+   Out of range Get, Top, Pop etc return a zeroed T.*/
+#define DEFINE_VECTOR(name, T) DEFINE_VECTOR__(name, T)
+
+/**Define a vector of T, as DEFINE_VECTOR, that keeps its first N elements
+   inside the struct itself, and only allocates once it outgrows them
+   (e.g. DEFINE_SMALLVECTOR(nodevector, node*, 8)).
+   As the buffer may point into the struct, it is initialized in place,
+     nodevector v; nodevectorInit(&v);
+   and must not be moved or copied while in use, except by the for_vector
+   macros (which work as usual) while the original is still there. So
+   nameInit, nameInitAlloc and nameDup take the vector to initialize.
+   Otherwise the interface is that of DEFINE_VECTOR, plus nameSpilled,
+   whether the elements have moved to the heap.*/
+#define DEFINE_SMALLVECTOR(name, T, N) DEFINE_SMALLVECTOR__(name, T, N)
+
 /*==== Inline implementations ====*/
 
 #include "stdlib.h"
@@ -129,6 +159,17 @@ inline static vector vectorInit (int initialCapacity, malloc_t malloc) {
         .buffer = malloc(initialCapacity*sizeof(void*))
     };
 }
+inline static vector vectorInitAlloc (int initialCapacity, const allocator* alloc) {
+    if (initialCapacity == 0)
+        initialCapacity++;
+
+    return (vector) {
+        .capacity = initialCapacity,
+        .buffer = allocatorMalloc(alloc, initialCapacity*sizeof(void*)),
+        .alloc = alloc
+    };
+}
+
 #define array_len__(array) sizeof(array)/sizeof(*(array))
 
 #define vectorInitFrom(array, malloc)                            \
@@ -198,7 +239,12 @@ static inline vector vectorsJoin (int n, malloc_t malloc, ...) {
 }
 
 inline static vector* vectorFree (vector* v) {
-    free(v->buffer);
+    if (v->alloc)
+        allocatorFree(v->alloc, v->buffer, v->capacity*sizeof(void*));
+
+    else
+        free(v->buffer);
+
     v->length = 0;
     v->capacity = 0;
     v->buffer = 0;
@@ -245,7 +291,11 @@ inline static int vectorFind (vector v, void* item) {
 }
 
 inline static void vectorResize (vector* v, int capacity, realloc_t realloc) {
-	if (capacity > v->capacity)
+    /*Allocators are told the size on free, so keep it exact*/
+    if (v->alloc)
+        v->buffer = allocatorRealloc(v->alloc, v->buffer, v->capacity*sizeof(void*), capacity*sizeof(void*));
+
+    else if (capacity > v->capacity)
         v->buffer = realloc(v->buffer, capacity*sizeof(void*));
 
     v->capacity = capacity;
@@ -275,10 +325,13 @@ inline static vector* vectorPushFromArray (vector* v, void** array, int length,
     if (elementSize == sizeof(void*))
         memcpy(v->buffer+v->length, array, length*elementSize);
 
-    /*Otherwise copy each element individually*/
+    /*Otherwise copy each element individually, after the existing ones,
+      zero extended into its slot*/
     else
-        for (int i = 0; i < length; i++)
-            memcpy(v->buffer+i, (char*) array + i*elementSize, elementSize);
+        for (int i = 0; i < length; i++) {
+            v->buffer[v->length+i] = 0;
+            memcpy(v->buffer+v->length+i, (char*) array + i*elementSize, elementSize);
+        }
 
     v->length += length;
     return v;
@@ -331,3 +384,276 @@ inline static vector vectorMapInit (void* (*f)(void*), vector src, malloc_t mall
 
     return result;
 }
+
+/*Reallocate the buffer of any kind of vector*/
+static inline void* vectorReallocBuffer (void* buffer, int capacity, int newCapacity, size_t elementSize,
+                                         const allocator* alloc, realloc_t realloc) {
+    if (alloc)
+        return allocatorRealloc(alloc, buffer, capacity*elementSize, newCapacity*elementSize);
+
+    else if (newCapacity > capacity)
+        return realloc(buffer, newCapacity*elementSize);
+
+    else
+        return buffer;
+}
+
+#define DEFINE_VECTOR__(name, T)                                                    \
+    typedef struct name {                                                          \
+        int length, capacity;                                                      \
+        T* buffer;                                                                 \
+        const allocator* alloc;                                                    \
+    } name;                                                                        \
+                                                                                   \
+    static inline name name##Init (int initialCapacity, malloc_t malloc) {         \
+        if (initialCapacity == 0)                                                  \
+            initialCapacity++;                                                     \
+                                                                                   \
+        return (name) {                                                            \
+            .capacity = initialCapacity,                                           \
+            .buffer = malloc(initialCapacity*sizeof(T))                            \
+        };                                                                         \
+    }                                                                              \
+                                                                                   \
+    static inline name name##InitAlloc (int initialCapacity,                       \
+                                        const allocator* alloc) {                  \
+        if (initialCapacity == 0)                                                  \
+            initialCapacity++;                                                     \
+                                                                                   \
+        return (name) {                                                            \
+            .capacity = initialCapacity,                                           \
+            .buffer = allocatorMalloc(alloc, initialCapacity*sizeof(T)),           \
+            .alloc = alloc                                                         \
+        };                                                                         \
+    }                                                                              \
+                                                                                   \
+    static inline name* name##Free (name* v) {                                     \
+        if (v->alloc)                                                              \
+            allocatorFree(v->alloc, v->buffer, v->capacity*sizeof(T));             \
+                                                                                   \
+        else                                                                       \
+            free(v->buffer);                                                       \
+                                                                                   \
+        v->length = 0;                                                             \
+        v->capacity = 0;                                                           \
+        v->buffer = 0;                                                             \
+        return v;                                                                  \
+    }                                                                              \
+                                                                                   \
+    static inline name* name##FreeObjs (name* v, void (*dtor)(T*)) {               \
+        for (int n = 0; n < v->length; n++)                                        \
+            dtor(&v->buffer[n]);                                                   \
+                                                                                   \
+        return name##Free(v);                                                      \
+    }                                                                              \
+                                                                                   \
+    static inline bool name##Null (name v) {                                       \
+        return v.buffer == 0;                                                      \
+    }                                                                              \
+                                                                                   \
+    static inline T* name##At (name v, int n) {                                    \
+        return n < v.length && n >= 0 ? &v.buffer[n] : 0;                          \
+    }                                                                              \
+                                                                                   \
+    static inline T name##Get (name v, int n) {                                    \
+        return n < v.length && n >= 0 ? v.buffer[n] : (T) {0};                     \
+    }                                                                              \
+                                                                                   \
+    static inline T name##Top (name v) {                                           \
+        return name##Get(v, v.length-1);                                           \
+    }                                                                              \
+                                                                                   \
+    static inline void name##Resize (name* v, int capacity) {                      \
+        v->buffer = vectorReallocBuffer(v->buffer, v->capacity, capacity,          \
+                                        sizeof(T), v->alloc, realloc);             \
+        v->capacity = capacity;                                                    \
+                                                                                   \
+        if (v->capacity < v->length)                                               \
+            v->length = capacity;                                                  \
+    }                                                                              \
+                                                                                   \
+    static inline int name##Push (name* v, T item) {                               \
+        if (v->length == v->capacity)                                              \
+            name##Resize(v, v->capacity*2);                                        \
+                                                                                   \
+        v->buffer[v->length] = item;                                               \
+        return v->length++;                                                        \
+    }                                                                              \
+                                                                                   \
+    static inline name* name##PushFromArray (name* v, const T* array, int length) {\
+        if (v->capacity < v->length + length)                                      \
+            name##Resize(v, v->capacity + length*2);                               \
+                                                                                   \
+        memcpy(v->buffer+v->length, array, length*sizeof(T));                      \
+        v->length += length;                                                       \
+        return v;                                                                  \
+    }                                                                              \
+                                                                                   \
+    static inline name name##Dup (name v, malloc_t malloc) {                       \
+        name dup = name##Init(v.length, malloc);                                   \
+        return *name##PushFromArray(&dup, v.buffer, v.length);                     \
+    }                                                                              \
+                                                                                   \
+    static inline T name##Pop (name* v) {                                          \
+        return v->length >= 1 ? v->buffer[--v->length] : (T) {0};                  \
+    }                                                                              \
+                                                                                   \
+    static inline bool name##Set (name* v, int n, T value) {                       \
+        if (n < v->length && n >= 0) {                                             \
+            v->buffer[n] = value;                                                  \
+            return false;                                                          \
+                                                                                   \
+        } else                                                                     \
+            return true;                                                           \
+    }                                                                              \
+                                                                                   \
+    static inline T name##RemoveReorder (name* v, int n) {                         \
+        if (v->length <= n)                                                        \
+            return (T) {0};                                                        \
+                                                                                   \
+        T last = name##Pop(v);                                                     \
+        name##Set(v, n, last);                                                     \
+        return last;                                                               \
+    }                                                                              \
+                                                                                   \
+    static inline void name##Map (name* dest, T (*f)(T), name src) {               \
+        int upto = src.length > dest->capacity ? dest->capacity : src.length;      \
+                                                                                   \
+        for (int n = 0; n < upto; n++)                                             \
+            dest->buffer[n] = f(src.buffer[n]);                                    \
+                                                                                   \
+        dest->length = upto;                                                       \
+    }
+
+#define DEFINE_SMALLVECTOR__(name, T, N)                                           \
+    typedef struct name {                                                          \
+        int length, capacity;                                                      \
+        T* buffer;                                                                 \
+        const allocator* alloc;                                                    \
+        T small[N];                                                                \
+    } name;                                                                        \
+                                                                                   \
+    static inline name* name##InitAlloc (name* v, const allocator* alloc) {        \
+        v->length = 0;                                                             \
+        v->capacity = N;                                                           \
+        v->buffer = v->small;                                                      \
+        v->alloc = alloc;                                                          \
+        return v;                                                                  \
+    }                                                                              \
+                                                                                   \
+    static inline name* name##Init (name* v) {                                     \
+        return name##InitAlloc(v, 0);                                              \
+    }                                                                              \
+                                                                                   \
+    static inline bool name##Spilled (const name* v) {                             \
+        return v->buffer != v->small;                                              \
+    }                                                                              \
+                                                                                   \
+    static inline name* name##Free (name* v) {                                     \
+        if (name##Spilled(v) && v->alloc)                                          \
+            allocatorFree(v->alloc, v->buffer, v->capacity*sizeof(T));             \
+                                                                                   \
+        else if (name##Spilled(v))                                                 \
+            free(v->buffer);                                                       \
+                                                                                   \
+        v->length = 0;                                                             \
+        v->capacity = 0;                                                           \
+        v->buffer = 0;                                                             \
+        return v;                                                                  \
+    }                                                                              \
+                                                                                   \
+    static inline name* name##FreeObjs (name* v, void (*dtor)(T*)) {               \
+        for (int n = 0; n < v->length; n++)                                        \
+            dtor(&v->buffer[n]);                                                   \
+                                                                                   \
+        return name##Free(v);                                                      \
+    }                                                                              \
+                                                                                   \
+    static inline bool name##Null (const name* v) {                                \
+        return v->buffer == 0;                                                     \
+    }                                                                              \
+                                                                                   \
+    static inline T* name##At (const name* v, int n) {                             \
+        return n < v->length && n >= 0 ? &v->buffer[n] : 0;                        \
+    }                                                                              \
+                                                                                   \
+    static inline T name##Get (const name* v, int n) {                             \
+        return n < v->length && n >= 0 ? v->buffer[n] : (T) {0};                   \
+    }                                                                              \
+                                                                                   \
+    static inline T name##Top (const name* v) {                                    \
+        return name##Get(v, v->length-1);                                          \
+    }                                                                              \
+                                                                                   \
+    /*It never moves back into the struct once spilled*/                          \
+    static inline void name##Resize (name* v, int capacity) {                      \
+        if (v->length > capacity)                                                  \
+            v->length = capacity;                                                  \
+                                                                                   \
+        if (name##Spilled(v))                                                      \
+            v->buffer = vectorReallocBuffer(v->buffer, v->capacity, capacity,      \
+                                            sizeof(T), v->alloc, realloc);         \
+                                                                                   \
+        else if (capacity > N) {                                                   \
+            v->buffer = v->alloc ? allocatorMalloc(v->alloc, capacity*sizeof(T))   \
+                                 : malloc(capacity*sizeof(T));                     \
+            memcpy(v->buffer, v->small, v->length*sizeof(T));                      \
+                                                                                   \
+        } else                                                                     \
+            capacity = N;                                                          \
+                                                                                   \
+        v->capacity = capacity;                                                    \
+    }                                                                              \
+                                                                                   \
+    static inline int name##Push (name* v, T item) {                               \
+        if (v->length == v->capacity)                                              \
+            name##Resize(v, v->capacity*2);                                        \
+                                                                                   \
+        v->buffer[v->length] = item;                                               \
+        return v->length++;                                                        \
+    }                                                                              \
+                                                                                   \
+    static inline name* name##PushFromArray (name* v, const T* array, int length) {\
+        if (v->capacity < v->length + length)                                      \
+            name##Resize(v, v->capacity + length*2);                               \
+                                                                                   \
+        memcpy(v->buffer+v->length, array, length*sizeof(T));                      \
+        v->length += length;                                                       \
+        return v;                                                                  \
+    }                                                                              \
+                                                                                   \
+    static inline name* name##Dup (name* dup, const name* v) {                     \
+        name##InitAlloc(dup, v->alloc);                                            \
+        return name##PushFromArray(dup, v->buffer, v->length);                     \
+    }                                                                              \
+                                                                                   \
+    static inline T name##Pop (name* v) {                                          \
+        return v->length >= 1 ? v->buffer[--v->length] : (T) {0};                  \
+    }                                                                              \
+                                                                                   \
+    static inline bool name##Set (name* v, int n, T value) {                       \
+        if (n < v->length && n >= 0) {                                             \
+            v->buffer[n] = value;                                                  \
+            return false;                                                          \
+                                                                                   \
+        } else                                                                     \
+            return true;                                                           \
+    }                                                                              \
+                                                                                   \
+    static inline T name##RemoveReorder (name* v, int n) {                         \
+        if (v->length <= n)                                                        \
+            return (T) {0};                                                        \
+                                                                                   \
+        T last = name##Pop(v);                                                     \
+        name##Set(v, n, last);                                                     \
+        return last;                                                               \
+    }                                                                              \
+                                                                                   \
+    static inline void name##Map (name* dest, T (*f)(T), const name* src) {        \
+        int upto = src->length > dest->capacity ? dest->capacity : src->length;    \
+                                                                                   \
+        for (int n = 0; n < upto; n++)                                             \
+            dest->buffer[n] = f(src->buffer[n]);                                   \
+                                                                                   \
+        dest->length = upto;                                                       \
+    }